@@ -0,0 +1,122 @@
+#include "compiler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN 16
+
+struct ArenaChunk {
+  struct ArenaChunk* prev;
+  size_t size;
+  char data[];
+};
+
+static inline size_t align_up(size_t n)
+{
+  return (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+void arena_init(struct Arena* arena, size_t chunk_size)
+{
+  *arena = (struct Arena){ .chunk_size = chunk_size };
+}
+
+// Makes a chunk with room for at least size bytes current. Chunks released
+// by arena_release are kept on a free list and reused before asking malloc
+// for a new one.
+static void arena_new_chunk(struct Arena* arena, size_t size)
+{
+  struct ArenaChunk* chunk = NULL;
+  if(arena->spare && arena->spare->size >= size) {
+    chunk = arena->spare;
+    arena->spare = chunk->prev;
+  } else {
+    size_t chunk_size = size > arena->chunk_size ? size : arena->chunk_size;
+    chunk = malloc(sizeof(struct ArenaChunk) + chunk_size);
+    if(!chunk) {
+      fprintf(stderr, "Failed to allocate arena chunk of %zu bytes.\n", chunk_size);
+      abort();
+    }
+    chunk->size = chunk_size;
+    arena->stats.chunks++;
+  }
+  chunk->prev = arena->chunk;
+  arena->chunk = chunk;
+  arena->ptr = chunk->data;
+  arena->end = chunk->data + chunk->size;
+}
+
+void* arena_alloc(struct Arena* arena, size_t size)
+{
+  size = align_up(size);
+  if((size_t)(arena->end - arena->ptr) < size) arena_new_chunk(arena, size);
+  void* ret = arena->ptr;
+  arena->ptr += size;
+  arena->stats.allocations++;
+  arena->stats.bytes += size;
+  return ret;
+}
+
+char* arena_strndup(struct Arena* arena, const char* str, size_t length)
+{
+  char* ret = arena_alloc(arena, length + 1);
+  memcpy(ret, str, length);
+  ret[length] = '\0';
+  return ret;
+}
+
+// Arrays in an arena use the same header as array.h, so array_length and
+// array_capacity work on them. Growing copies into a new block; the old one
+// is reclaimed with the rest of the scope.
+void* arena_array_new(struct Arena* arena, size_t capacity, size_t elem_size)
+{
+  struct ArrayHeader* header = arena_alloc(arena, sizeof(struct ArrayHeader)
+                                                  + capacity * elem_size);
+  header->length = 0;
+  header->capacity = capacity;
+  return header + 1;
+}
+
+void* arena_array_grow(struct Arena* arena, void* array, size_t elem_size)
+{
+  void* grown = arena_array_new(arena, 2 * array_capacity(array), elem_size);
+  memcpy(grown, array, array_length(array) * elem_size);
+  array_length(grown) = array_length(array);
+  return grown;
+}
+
+struct ArenaMark arena_mark(struct Arena* arena)
+{
+  return (struct ArenaMark){ .chunk = arena->chunk, .ptr = arena->ptr };
+}
+
+// Frees everything allocated since mark was taken.
+void arena_release(struct Arena* arena, struct ArenaMark mark)
+{
+  while(arena->chunk != mark.chunk) {
+    struct ArenaChunk* chunk = arena->chunk;
+    arena->chunk = chunk->prev;
+    chunk->prev = arena->spare;
+    arena->spare = chunk;
+  }
+  arena->ptr = mark.ptr;
+  arena->end = arena->chunk ? arena->chunk->data + arena->chunk->size : NULL;
+}
+
+void arena_free(struct Arena* arena)
+{
+  struct ArenaChunk* lists[2] = { arena->chunk, arena->spare };
+  for(int i = 0; i < 2; i++) {
+    struct ArenaChunk* chunk = lists[i];
+    while(chunk) {
+      struct ArenaChunk* prev = chunk->prev;
+      free(chunk);
+      chunk = prev;
+    }
+  }
+  arena->chunk = NULL;
+  arena->spare = NULL;
+  arena->ptr = NULL;
+  arena->end = NULL;
+}
@@ -0,0 +1,13 @@
+#include "array.h"
+
+#include <stdio.h>
+
+struct ArrayHeader* array_allocate(struct ArrayHeader* header, size_t size)
+{
+  header = realloc(header, size);
+  if(!header) {
+    fprintf(stderr, "Failed to allocate an array of %zu bytes.\n", size);
+    abort();
+  }
+  return header;
+}
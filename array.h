@@ -11,14 +11,23 @@ struct ArrayHeader { unsigned long length, capacity;};
 #define array_length(a) (((struct ArrayHeader*)(a)-1)->length)
 #define array_capacity(a) (((struct ArrayHeader*)(a)-1)->capacity)
 
+// Resizes the block of an array's header and elements, or allocates it if
+// header is NULL, aborting if there is no memory for it.
+struct ArrayHeader* array_allocate(struct ArrayHeader* header, size_t size);
+
 #define array_new() \
-  (void*)((struct ArrayHeader*)malloc(sizeof(struct ArrayHeader)) + 1)
+  (void*)(array_allocate(NULL, sizeof(struct ArrayHeader)) + 1)
+
+#define array_new_capacity(a, c) \
+  (*(a) = (void*)(array_allocate(NULL, sizeof(struct ArrayHeader) \
+    + (c)*sizeof(**(a))) + 1), \
+   array_length(*(a)) = 0, array_capacity(*(a)) = (c))
 
 #define array_free(a) free((struct ArrayHeader*)(a) - 1)
 
 #define array_ensure(a, c) \
-  *(a) = (void*)((struct ArrayHeader*) realloc( (struct ArrayHeader*)(*(a)) - 1, \
-    sizeof(struct ArrayHeader) + (array_capacity(*(a)) = (c))*sizeof(**(a)) ) + 1)
+  *(a) = (void*)(array_allocate((struct ArrayHeader*)(*(a)) - 1, \
+    sizeof(struct ArrayHeader) + (array_capacity(*(a)) = (c))*sizeof(**(a))) + 1)
 
 #define array_append(a, v) \
   (array_length(*(a)) >= array_capacity(*(a)) ? \
@@ -0,0 +1,74 @@
+#include "compiler.h"
+#include "array.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Every distinct identifier spelling is interned once. The records are
+// allocated from an arena so that pointers to them stay valid as the map
+// and the id list grow. Each record is followed by a copy of its spelling,
+// so comparing a name against an atom touches no memory besides the atom.
+static struct Arena atom_arena;
+static struct HashMap atom_map; // Spelling to struct Atom*
+static Array(struct Atom*) atom_list;
+
+void atoms_init()
+{
+  arena_init(&atom_arena, 1 << 14);
+  map_init(&atom_map, sizeof(struct Atom*));
+  atom_list = array_new();
+  array_length(atom_list) = 0;
+  array_capacity(atom_list) = 0;
+  array_ensure(&atom_list, 256);
+}
+
+void atoms_free()
+{
+  arena_free(&atom_arena);
+  map_free(&atom_map);
+  array_free(atom_list);
+  atom_list = NULL;
+}
+
+// hash must be strview_hash(name); the lexer computes it while scanning.
+struct Atom* atom_intern_hashed(struct string_view name, uint64_t hash)
+{
+  bool is_new;
+  struct Atom** entry = map_insert(&atom_map, name, hash, &is_new);
+  if(!is_new) return *entry;
+
+  struct Atom* atom = arena_alloc(&atom_arena,
+                                  sizeof(struct Atom) + name.length);
+  memcpy(atom + 1, name.begin, name.length);
+  *atom = (struct Atom){
+    .name = { .begin = (char*)(atom + 1), .length = name.length },
+    .hash = hash,
+    .id = (int)array_length(atom_list),
+    .type = IDENTIFIER_TOK,
+    .builtin = BUILTIN_NONE,
+    .is_macro = false,
+    .is_function_like = false
+  };
+  if(array_length(atom_list) >= array_capacity(atom_list)) {
+    array_ensure(&atom_list, 2 * array_capacity(atom_list));
+  }
+  atom_list[array_length(atom_list)++] = atom;
+  *entry = atom;
+  return atom;
+}
+
+struct Atom* atom_intern(struct string_view name)
+{
+  return atom_intern_hashed(name, strview_hash(name));
+}
+
+struct Atom* atom_get(int id)
+{
+  return atom_list[id];
+}
+
+int atom_count()
+{
+  return (int)array_length(atom_list);
+}
@@ -0,0 +1,81 @@
+// #define/#undef churn on a macro table that already holds 1000 macros:
+// X-macro style, redefining the same 64 names over and over, and with a
+// fresh name each cycle. Table size and probe lengths should stay flat.
+// Build with `make bench` and run bench/churn_bench.
+#include "compiler.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define RESIDENT 1000
+#define CYCLES 4000000
+#define REPORTS 4
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static struct string_view* make_names(const char* format, size_t n)
+{
+  struct string_view* names = malloc(n * sizeof(*names));
+  for(size_t i = 0; i < n; i++) {
+    char* name = malloc(32);
+    int length = sprintf(name, format, i);
+    names[i] = (struct string_view){ .begin = name, .length = (size_t)length };
+  }
+  return names;
+}
+
+static void churn(const char* title, struct string_view* names, size_t n)
+{
+  struct string_view* resident = make_names("RESIDENT_%zu", RESIDENT);
+  int param = atom_intern((struct string_view){ .begin = "a", .length = 1 })->id;
+
+  MacroTable t;
+  macro_table_init(&t);
+  for(size_t i = 0; i < RESIDENT; i++) {
+    macro_table_set(&t, resident[i], strview_hash(resident[i]),
+                    (struct Macro){ .file_id = -1 });
+  }
+
+  printf("%s\n", title);
+  double start = now();
+  for(size_t cycle = 1; cycle <= CYCLES; cycle++) {
+    Array(int) params;
+    array_new_capacity(&params, 1);
+    params[array_length(params)++] = param;
+    struct Macro macro = { .params = params, .file_id = -1,
+                           .function_like = true };
+    struct string_view name = names[cycle % n];
+    uint64_t hash = strview_hash(name);
+    macro_table_set(&t, name, hash, macro);
+    macro_table_delete(&t, name, hash);
+
+    if(cycle % (CYCLES / REPORTS) == 0) {
+      struct MapStats stats;
+      map_stats(&t, &stats);
+      printf("  %8zu cycles: %.1f ns/cycle, capacity %zu, %zu bytes, "
+             "%zu tombstones, probe mean %.2f max %zu\n",
+             cycle, (now() - start) / (double)cycle * 1e9, stats.capacity,
+             stats.bytes, stats.tombstones, stats.mean_probe,
+             stats.max_probe);
+    }
+  }
+  macro_table_destroy(&t);
+}
+
+int main()
+{
+  atoms_init();
+  struct string_view* x_names = make_names("X_%zu", 64);
+  churn("64 names redefined", x_names, 64);
+
+  struct string_view* fresh = make_names("TMP_%zu", CYCLES);
+  churn("fresh name every cycle", fresh, CYCLES);
+  return 0;
+}
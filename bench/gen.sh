@@ -0,0 +1,179 @@
+#!/bin/sh
+# Generates synthetic inputs for `ccomp --bench`.
+# Usage: bench/gen.sh <kind> <lines> > file.c
+#   idents  identifier and keyword heavy declarations
+#   strings table of long string literals with escapes
+#   macros  expressions made of object-like and function-like macro uses
+#   defines a large header of macro definitions, mostly function-like
+#   pp      Boost.PP-style repetition: each line expands a chain of
+#           function-like macros 16 deep
+#   recursive  self-referential and mutually recursive macros, where each
+#              line expands a chain $DEPTH (default 256) macros deep
+#   paste   generated names: each line expands a chain $DEPTH (default
+#           1000) macros deep that pastes a name at every level and
+#           stringifies one at the bottom
+#   logging calls to a variadic logging macro that uses its level and
+#           format 3-4 times each, passing macros and nested calls as
+#           arguments
+#   includes  a tree of $FILES (default 64) guarded headers written to
+#             $DIR (default ./gen_include), each including the ones before
+#             it, and a unit including one of them on every other line;
+#             run it with -I$DIR
+#   disabled  a header made mostly of conditional groups that are not
+#             read: #if 0 blocks and platform branches of code, comments
+#             and nested conditionals, each chain of them ending in an
+#             active #else line
+#   comments  the comments of the system headers in $HEADERS (default
+#             /usr/include/*.h), with each line of code replaced by a
+#             declaration; <lines> is the number of passes over them
+
+kind=$1
+lines=${2:-100000}
+
+case $kind in
+idents)
+  awk -v n="$lines" 'BEGIN {
+    for(i = 0; i < n; i++)
+      printf "static const unsigned long value_%d = other_name_%d + while_not_kw * sizeof_thing;\n", i % 997, i % 313
+  }'
+  ;;
+strings)
+  awk -v n="$lines" 'BEGIN {
+    for(i = 0; i < n; i++)
+      printf "  \"SELECT id, name, \\\"payload\\\" FROM table_%d WHERE key = \x27{\\\"k\\\": %d, \\\"v\\\": [1, 2, 3]}\x27 ORDER BY id LIMIT 100;\\n\",\n", i % 97, i
+  }'
+  ;;
+macros)
+  awk -v n="$lines" 'BEGIN {
+    print "#define ZERO 0"
+    print "#define ONE 1"
+    print "#define TWO (ONE + ONE)"
+    print "#define ADD(a, b) ((a) + (b))"
+    print "#define MUL(a, b) ((a) * (b))"
+    for(i = 0; i < n; i++)
+      printf "int v_%d = ADD(ONE, x_%d) * MUL(TWO, ZERO) + ADD(TWO, ONE);\n", i % 997, i % 89
+  }'
+  ;;
+defines)
+  awk -v n="$lines" 'BEGIN {
+    for(i = 0; i < n; i++)
+      if(i % 4 == 0)
+        printf "#define CONST_%d (%d << 2)\n", i, i
+      else
+        printf "#define FN_%d(first, second, third) ((first) + (second) * (third) + %d)\n", i, i
+    print "int last = FN_1(CONST_0, 2, 3);"
+  }'
+  ;;
+pp)
+  awk -v n="$lines" 'BEGIN {
+    print "#define PP_ADD(a, b) ((a) + (b))"
+    print "#define PP_ELEM(x, i) PP_ADD(x, i),"
+    print "#define PP_REP0(M, x)"
+    for(i = 1; i <= 32; i++)
+      printf "#define PP_REP%d(M, x) PP_REP%d(M, x) M(x, %d)\n", i, i - 1, i - 1
+    for(i = 0; i < n; i++)
+      printf "int v_%d[] = { PP_REP16(PP_ELEM, x_%d) 0 };\n", i % 997, i % 89
+  }'
+  ;;
+recursive)
+  awk -v n="$lines" -v depth="${DEPTH:-256}" 'BEGIN {
+    print "#define self self"
+    print "#define PING(x) PONG(x + 1)"
+    print "#define PONG(x) PING(x * 2)"
+    print "#define D0 d0 D0"
+    for(i = 1; i <= depth; i++)
+      printf "#define D%d D%d D%d\n", i, i - 1, i
+    for(i = 0; i < n; i++)
+      printf "int v_%d = self + PING(%d) + PONG(%d), D%d;\n", i % 997, i, i, depth - i % 8
+  }'
+  ;;
+paste)
+  awk -v n="$lines" -v depth="${DEPTH:-1000}" 'BEGIN {
+    print "#define CAT(a, b) a ## b"
+    print "#define STR(x) #x"
+    print "#define CHAIN0(x) STR(x)"
+    for(i = 1; i <= depth; i++)
+      printf "#define CHAIN%d(x) CAT(x, _%d), CHAIN%d(x)\n", i, i, i - 1
+    for(i = 0; i < n; i++)
+      printf "const char* v_%d[] = { CHAIN%d(x_%d) };\n", i % 997, depth - i % 8, i % 89
+  }'
+  ;;
+logging)
+  awk -v n="$lines" 'BEGIN {
+    print "#define LVL_DEBUG 0"
+    print "#define LVL_WARN 2"
+    print "#define MIN(a, b) ((a) < (b) ? (a) : (b))"
+    print "#define ENABLED(lvl) ((lvl) >= log_level && (lvl) <= LVL_WARN)"
+    print "#define LOG(lvl, fmt, ...) do { if(ENABLED(lvl)) log_write((lvl), #lvl, \"%s:%d: \" fmt, log_file, (lvl) __VA_OPT__(,) __VA_ARGS__); } while(0)"
+    for(i = 0; i < n; i++)
+      if(i % 2)
+        printf "LOG(LVL_WARN, \"value %%d of %%d\", MIN(x_%d, LVL_WARN), MIN(y_%d, (z, w)));\n", i % 89, i % 97
+      else
+        printf "LOG(MIN(LVL_DEBUG, level_%d), \"done\");\n", i % 89
+  }'
+  ;;
+includes)
+  dir=${DIR:-gen_include}
+  mkdir -p "$dir"
+  awk -v n="$lines" -v files="${FILES:-64}" -v dir="$dir" 'BEGIN {
+    for(f = 0; f < files; f++) {
+      h = sprintf("%s/header_%d.h", dir, f)
+      printf "/* Generated header %d */\n#ifndef HEADER_%d_H\n#define HEADER_%d_H\n", f, f, f > h
+      for(i = 0; i < f; i++)
+        printf "#include \"header_%d.h\"\n", i > h
+      for(i = 0; i < 200; i++)
+        printf "extern unsigned long header_%d_value_%d(const char* name, int count);\n", f, i > h
+      printf "#endif /* HEADER_%d_H */\n", f > h
+      close(h)
+    }
+    for(i = 0; i < n; i++)
+      if(i % 2)
+        printf "int v_%d = u_%d;\n", i % 997, i % 89
+      else
+        printf "#include <header_%d.h>\n", i % files
+  }'
+  ;;
+disabled)
+  awk -v n="$lines" 'BEGIN {
+    print "#define HAVE_FEATURE 1"
+    for(i = 0; i < n; i += 8) {
+      if(i % 64 == 0) printf "#if 0\n"
+      else if(i % 64 == 32) printf "#elif defined(__vms) || OTHER_PLATFORM > 2\n"
+      if(i % 64 < 32) {
+        printf "/* Legacy implementation %d, kept for reference.\n#endif in a comment */\n", i
+        printf "#ifdef LEGACY_%d\n", i % 13
+        printf "static unsigned long legacy_%d(const char* s) { return s[0] == '#' ? %d : 0; }\n", i, i
+        printf "#endif\n"
+        printf "#define LEGACY_NAME_%d \"legacy/*%d*/\"\n", i, i
+      } else {
+        printf "  int platform_value_%d = OTHER_PLATFORM * %d; // not this one\n", i, i
+        printf "# if OTHER_PLATFORM > 3\n  long wide_%d;\n# else\n  short narrow_%d;\n# endif\n", i, i
+      }
+      if(i % 64 == 56) printf "#else\nint active_%d = HAVE_FEATURE;\n#endif\n", i
+    }
+  }'
+  ;;
+comments)
+  for pass in $(seq "$lines"); do
+    cat ${HEADERS:-/usr/include/*.h}
+  done | awk '
+  {
+    out = ""; code = 0
+    for(i = 1; i <= length($0); i++) {
+      c = substr($0, i, 2)
+      if(block) {
+        if(c == "*/") { out = out "*/"; i++; block = 0 }
+        else out = out substr($0, i, 1)
+      } else if(c == "/*") { out = out "/*"; i++; block = 1 }
+      else if(c == "//") { out = out substr($0, i); break }
+      else if(substr($0, i, 1) !~ /[ \t]/) code = 1
+    }
+    if(code) out = out " int field_" NR % 1000 ";"
+    print out
+  }'
+  ;;
+*)
+  echo "unknown kind: $kind" >&2
+  exit 1
+  ;;
+esac
@@ -0,0 +1,144 @@
+// Distribution and speed of strview_hash against the byte-at-a-time FNV-1a
+// it replaced, over the distinct identifiers in the files given.
+// Build with `make bench` and run e.g. bench/hash_bench /usr/include/*.h
+#include "compiler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static uint64_t fnv1a(struct string_view sv)
+{
+  uint64_t hash = 0xcbf29ce484222325;
+  for(size_t i = 0; i < sv.length; i++) {
+    hash ^= (uint8_t)sv.begin[i];
+    hash *= 0x00000100000001B3;
+  }
+  return hash;
+}
+
+static int is_ident(char c, int first)
+{
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_'
+      || (!first && c >= '0' && c <= '9');
+}
+
+static char* read_file(const char* name, size_t* size)
+{
+  FILE* file = fopen(name, "rb");
+  if(!file) return NULL;
+  fseek(file, 0, SEEK_END);
+  *size = (size_t)ftell(file);
+  rewind(file);
+  char* buffer = malloc(*size + 1);
+  *size = fread(buffer, 1, *size, file);
+  fclose(file);
+  return buffer;
+}
+
+static int compare_hashes(const void* a, const void* b)
+{
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+// Chi-squared over buckets divided by its degrees of freedom; close to 1
+// for a uniform hash.
+static double chi_squared(const uint64_t* hashes, size_t n, int shift,
+                          uint64_t buckets)
+{
+  size_t* counts = calloc(buckets, sizeof(*counts));
+  for(size_t i = 0; i < n; i++) counts[(hashes[i] >> shift) & (buckets - 1)]++;
+  double expected = (double)n / (double)buckets, sum = 0;
+  for(uint64_t b = 0; b < buckets; b++) {
+    double d = (double)counts[b] - expected;
+    sum += d * d / expected;
+  }
+  free(counts);
+  return sum / (double)(buckets - 1);
+}
+
+static void report(const char* name, uint64_t (*hash)(struct string_view),
+                   struct string_view* idents, size_t n)
+{
+  uint64_t* hashes = malloc(n * sizeof(*hashes));
+  // Timed on a cache-resident sample
+  size_t sample = n < 4096 ? n : 4096;
+  volatile uint64_t sink = 0;
+  double start = now();
+  for(int rep = 0; rep < 2000; rep++) {
+    for(size_t i = 0; i < sample; i++) sink += hash(idents[i]);
+  }
+  double ns = (now() - start) / (2000.0 * (double)sample) * 1e9;
+
+  struct HashMap map;
+  map_init(&map, 0);
+  for(size_t i = 0; i < n; i++) {
+    hashes[i] = hash(idents[i]);
+    map_insert(&map, idents[i], hashes[i], NULL);
+  }
+  struct MapStats stats;
+  map_stats(&map, &stats);
+  map_free(&map);
+
+  double low = chi_squared(hashes, n, 0, 4096);
+  double h2 = chi_squared(hashes, n, 57, 128);
+  qsort(hashes, n, sizeof(*hashes), compare_hashes);
+  size_t collisions = 0;
+  for(size_t i = 1; i < n; i++) collisions += hashes[i] == hashes[i - 1];
+
+  printf("%-12s %5.1f ns/ident, chi2/df low 12 bits %.2f, top 7 bits %.2f, "
+         "64-bit collisions %zu, probe mean %.3f max %zu\n", name, ns, low,
+         h2, collisions, stats.mean_probe, stats.max_probe);
+  free(hashes);
+}
+
+int main(int argc, char** argv)
+{
+  struct HashMap unique;
+  map_init(&unique, 0);
+  size_t total = 0;
+  for(int f = 1; f < argc; f++) {
+    size_t size;
+    char* buffer = read_file(argv[f], &size);
+    if(!buffer) continue;
+    for(size_t i = 0; i < size;) {
+      if(!is_ident(buffer[i], 1) || (i && is_ident(buffer[i - 1], 0))) {
+        i++;
+        continue;
+      }
+      struct string_view ident = { .begin = buffer + i, .length = 0 };
+      while(i < size && is_ident(buffer[i], 0)) i++;
+      ident.length = (size_t)(buffer + i - ident.begin);
+      map_insert(&unique, ident, fnv1a(ident), NULL);
+      total++;
+    }
+  }
+
+  // Packed next to each other so that timing measures the hash rather
+  // than cache misses on the file buffers
+  struct string_view* idents = malloc((unique.count + 1) * sizeof(*idents));
+  size_t n = 0, index = 0, bytes = 0;
+  struct string_view key;
+  while(map_next(&unique, &index, &key)) bytes += key.length;
+  char* packed = malloc(bytes + 1);
+  for(index = 0, bytes = 0; map_next(&unique, &index, &key); bytes += key.length) {
+    memcpy(packed + bytes, key.begin, key.length);
+    idents[n++] = (struct string_view){ .begin = packed + bytes,
+                                        .length = key.length };
+  }
+  printf("%zu identifiers, %zu distinct\n", total, n);
+  if(n == 0) return 0;
+
+  report("fnv-1a", fnv1a, idents, n);
+  report("strview_hash", strview_hash, idents, n);
+  return 0;
+}
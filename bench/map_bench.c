@@ -0,0 +1,61 @@
+// Macro table lookup latency with 1k, 10k and 100k macros defined, for
+// names that are macros and for ordinary identifiers that are not.
+// Build with `make bench` and run bench/map_bench.
+#include "compiler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define LOOKUPS 10000000
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// Nanoseconds per lookup of keys[0..n), visited in a scattered order.
+static double time_lookups(MacroTable* t, struct string_view* keys, size_t n)
+{
+  size_t found = 0;
+  double start = now();
+  for(size_t i = 0; i < LOOKUPS; i++) {
+    struct string_view key = keys[(i * 7919) % n];
+    found += macro_table_get(t, key, strview_hash(key)) != NULL;
+  }
+  double elapsed = now() - start;
+  if(found != 0 && found != LOOKUPS) printf("unexpected hit count %zu\n", found);
+  return elapsed / LOOKUPS * 1e9;
+}
+
+int main()
+{
+  const size_t sizes[] = { 1000, 10000, 100000 };
+  for(size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    size_t n = sizes[s];
+    struct string_view* keys = malloc(2 * n * sizeof(*keys));
+    for(size_t i = 0; i < 2 * n; i++) {
+      char* name = malloc(32);
+      int length = sprintf(name, i < n ? "MACRO_NAME_%zu" : "identifier_%zu", i);
+      keys[i] = (struct string_view){ .begin = name, .length = (size_t)length };
+    }
+
+    MacroTable t;
+    macro_table_init(&t);
+    for(size_t i = 0; i < n; i++) {
+      macro_table_set(&t, keys[i], strview_hash(keys[i]),
+                      (struct Macro){ .file_id = -1 });
+    }
+
+    double hit = time_lookups(&t, keys, n);
+    double miss = time_lookups(&t, keys + n, n);
+    printf("%6zu macros: hit %.1f ns, miss %.1f ns\n", n, hit, miss);
+
+    macro_table_destroy(&t);
+    for(size_t i = 0; i < 2 * n; i++) free(keys[i].begin);
+    free(keys);
+  }
+  return 0;
+}
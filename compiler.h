@@ -3,62 +3,201 @@
 
 #include "array.h"
 
+#include <stdint.h>
+
+// Bump allocator. Allocations are freed all at once, either by releasing
+// the arena back to a mark taken earlier or by freeing the whole arena.
+struct ArenaChunk;
+
+struct ArenaStats {
+  unsigned long allocations;
+  unsigned long bytes;
+  unsigned long chunks; // Calls to malloc
+};
+
+struct Arena {
+  struct ArenaChunk* chunk;
+  struct ArenaChunk* spare;
+  char* ptr;
+  char* end;
+  size_t chunk_size;
+  struct ArenaStats stats;
+};
+
+struct ArenaMark {
+  struct ArenaChunk* chunk;
+  char* ptr;
+};
+
+void arena_init(struct Arena* arena, size_t chunk_size);
+void* arena_alloc(struct Arena* arena, size_t size);
+char* arena_strndup(struct Arena* arena, const char* str, size_t length);
+void* arena_array_new(struct Arena* arena, size_t capacity, size_t elem_size);
+void* arena_array_grow(struct Arena* arena, void* array, size_t elem_size);
+struct ArenaMark arena_mark(struct Arena* arena);
+void arena_release(struct Arena* arena, struct ArenaMark mark);
+void arena_free(struct Arena* arena);
+
 struct string_view {
   char* begin;
   size_t length;
 };
 
-unsigned long strview_hash(struct string_view sv);
+uint64_t strview_hash(struct string_view sv);
 int strviewcmp(struct string_view svL, struct string_view svR);
 char* strviewtostr(struct string_view sv);
 
 void array_sv_ensure(Array(struct string_view)* array, size_t capacity);
 void array_sv_append(Array(struct string_view)* array, struct string_view sv);
 
+struct MacroToken;
+
+// A macro's replacement list is lexed once, when it is defined.
 struct Macro {
-  struct string_view text;
-  Array(struct string_view) arg_names;
+  Array(struct MacroToken) body;
+  Array(int) params; // Atom ids of the parameters, NULL if object-like
+  int file_id;       // Where it was defined; the body's spellings point there
+  _Bool function_like;
+  _Bool variadic;      // The last parameter takes the rest of the arguments
+  _Bool has_operators; // #, ## or __VA_OPT__ in the body, which expanding
+                       // it must apply
 };
 
-struct Macro macro_copy(struct Macro to_copy);
-char* macro_expand(struct Macro macro, Array(struct string_view) arguments);
+void macro_resolve_params(struct Macro* macro);
 
-struct KeyValueStrView {
-  struct string_view key;
-  struct string_view value;
+// Open-addressing hash map from string_view keys to values of value_size
+// bytes. Callers pass in the hash of the key, which is stored next to it so
+// probing and resizing never rehash. The key's characters are not copied.
+struct HashMap {
+  uint8_t* ctrl;
+  char* slots;
+  size_t capacity;   // Power of two, at least 16
+  size_t count;      // Live entries
+  size_t tombstones; // Deleted entries still on some probe sequence
+  size_t value_size;
+  size_t slot_size;
 };
 
-struct KeyValueMacro {
-  struct string_view key;
-  struct Macro value; 
+void map_init(struct HashMap* map, size_t value_size);
+void map_free(struct HashMap* map);
+void* map_find(const struct HashMap* map, struct string_view key,
+               uint64_t hash);
+void* map_insert(struct HashMap* map, struct string_view key, uint64_t hash,
+                 _Bool* is_new);
+_Bool map_remove(struct HashMap* map, struct string_view key, uint64_t hash,
+                 void* value);
+void* map_next(const struct HashMap* map, size_t* index,
+               struct string_view* key);
+
+struct MapStats {
+  size_t count;
+  size_t tombstones;
+  size_t capacity;
+  size_t bytes;
+  double mean_probe; // Groups looked at to find a live key
+  size_t max_probe;
 };
 
-struct HashTableHeader {
-  unsigned long capacity;
-  unsigned long filled;
+void map_stats(const struct HashMap* map, struct MapStats* stats);
+
+// Object-like and function-like macros share one table.
+#define MacroTable struct HashMap
+
+void macro_table_init(MacroTable* t);
+void macro_table_destroy(MacroTable* t);
+// hash is strview_hash(key), which callers usually already have.
+struct Macro* macro_table_get(const MacroTable* t, struct string_view key,
+                              uint64_t hash);
+// Takes ownership of value.body and value.params.
+_Bool macro_table_set(MacroTable* t, struct string_view key, uint64_t hash,
+                      struct Macro value);
+_Bool macro_table_delete(MacroTable* t, struct string_view key,
+                         uint64_t hash);
+
+enum SourceKind {
+  SOURCE_FILE,
+  SOURCE_EXPANSION
 };
 
-#define PreprocessorTable struct KeyValueStrView* 
-#define MacroTable struct KeyValueMacro*
+// Every file and macro expansion buffer the lexer reads from is registered
+// once with the source manager and referred to by its index from then on.
+struct SourceFile {
+  const char* name;
+  char* buffer;        // What the lexer reads, with line splices removed
+  size_t size;
+  size_t map_size;     // Non-zero if buffer is an mmap of the file
+  size_t* splices;     // Offsets in buffer where a backslash-newline was
+  size_t splice_count;
+  enum SourceKind kind;
+  int parent;      // Including file or expansion site, -1 for the main file
+  int parent_line;
+};
 
-PreprocessorTable preproc_table_create();
-void preproc_table_destroy(PreprocessorTable t);
+// What loading files has cost in system calls, and how many loads were
+// saved by finding that the file had been loaded under another name.
+struct SourceStats {
+  unsigned long opened;
+  unsigned long shared;
+  unsigned long syscalls;
+  unsigned long spliced;      // Files with a backslash-newline
+  unsigned long splice_bytes; // Bytes rewritten to remove them
+};
 
-MacroTable macro_table_create();
-void macro_table_destroy(MacroTable t);
+// Returns the id of filename if it has been loaded already and -1 if not.
+int source_find_file(const char* filename);
+// A file that was loaded under another name, unchanged since, is shared.
+int source_add_file(const char* filename, int parent, int parent_line);
+int source_add_expansion(int parent, int parent_line, char* buffer, size_t size);
+const struct SourceFile* source_get(int id);
+const char* source_name(int id);
+int source_count();
+void source_release_all();
+void source_stats(struct SourceStats* stats);
 
-struct string_view preproc_table_get(PreprocessorTable t, 
-                                     struct string_view key);
-_Bool preproc_table_set(PreprocessorTable* t,
-                        struct string_view key,
-                        struct string_view value);
-_Bool preproc_table_delete(PreprocessorTable* t,
-                           struct string_view key);
+struct IncludeStats {
+  unsigned long lookups;
+  unsigned long cache_hits;  // Spellings resolved before from the same place
+  unsigned long not_found;
+  unsigned long dirs_listed;
+  unsigned long entries;
+  unsigned long entries_stated; // Entries whose type needed a stat
+  unsigned long prefetched_used; // Files loaded after the prefetcher read
+                                 // them
+};
 
-struct Macro macro_table_get(MacroTable t, struct string_view key);
-_Bool macro_table_set(MacroTable* t, struct string_view key,
-                      struct Macro value);
-_Bool macro_table_delete(MacroTable* t, struct string_view key);
+// Adds a directory to search for #include files, ahead of the system ones.
+// Must be called before include_init.
+void add_include_dir(const char* dir);
+void include_init();
+void include_free();
+// Returns the file id of what #include "name" (or <name> if not quoted)
+// in includer names, loading it if needed, or -1 if there is none. With
+// next set it is #include_next instead.
+int include_resolve(struct string_view name, _Bool quoted, _Bool next,
+                    int includer, int line);
+// Whether include_resolve would find a file, without loading it.
+_Bool include_exists(struct string_view name, _Bool quoted, int includer);
+void include_stats(struct IncludeStats* stats);
+// Hands the files the #include directives of a file name to the
+// prefetcher, before they are reached.
+void include_prefetch(int file_id);
+
+struct PrefetchStats {
+  unsigned long files_requested;
+  unsigned long files_read;
+  unsigned long bytes_read;
+};
+
+// Off by default. Must be called before include_init.
+void prefetch_enable(_Bool enable);
+void prefetch_start();
+_Bool prefetch_running();
+// Returns an index to pass to prefetch_was_read, or -1 if the request was
+// dropped.
+long prefetch_file(const char* path);
+_Bool prefetch_was_read(long index);
+void prefetch_stop();
+void prefetch_stats(struct PrefetchStats* stats);
 
 enum TType {
   UNKNOWN_TOK = 0,
@@ -169,6 +308,8 @@ enum TType {
   LSQUARE_LSQUARE_TOK,
   RSQUARE_TOK,
   RSQUARE_RSQUARE_TOK,
+  HASH_TOK,
+  HASH_HASH_TOK,
   CHAR_LITERAL_TOK,
   U8_CHAR_LITERAL_TOK,
   U16_CHAR_LITERAL_TOK,
@@ -216,17 +357,111 @@ enum TType {
   EOF_TOK
 };
 
+// Predefined macros. They have no macro table entry: their atoms are
+// flagged when the lexer is set up, and each occurrence is replaced by a
+// value made from the lexer's state where it is expanded.
+enum BuiltinMacro {
+  BUILTIN_NONE,
+  BUILTIN_LINE,
+  BUILTIN_FILE,
+  BUILTIN_COUNTER,
+  BUILTIN_DATE,
+  BUILTIN_TIME,
+  BUILTIN_STDC,
+  BUILTIN_STDC_HOSTED,
+  BUILTIN_STDC_VERSION,
+  NUM_BUILTIN
+};
+
+// An interned identifier. Each distinct spelling gets one record and a
+// dense id, so identifiers can be compared by id.
+struct Atom {
+  struct string_view name;
+  uint64_t hash;    // strview_hash(name)
+  int id;
+  enum TType type;  // The keyword's token, or IDENTIFIER_TOK
+  enum BuiltinMacro builtin; // Unless redefined or #undef'd
+  _Bool is_macro;   // Currently #defined, or a builtin
+  _Bool is_function_like; // Currently defined with a parameter list
+};
+
+void atoms_init();
+void atoms_free();
+struct Atom* atom_intern(struct string_view name);
+struct Atom* atom_intern_hashed(struct string_view name, uint64_t hash);
+struct Atom* atom_get(int id);
+int atom_count();
+
+// Hide sets: the macros whose expansion a token came out of, which must not
+// expand it again. Each distinct set is interned and named by an id, and 0
+// is the empty set.
+struct HideSetStats {
+  size_t sets;
+  unsigned long cache_hits;
+  unsigned long cache_misses;
+};
+
+void hidesets_init();
+void hidesets_free();
+int hideset_add(int set, int atom);
+int hideset_union(int a, int b);
+int hideset_intersect(int a, int b);
+_Bool hideset_contains(int set, int atom);
+void hideset_stats(struct HideSetStats* stats);
+
 struct Token {
-  char* file;
+  int file_id;
   int line;
   int position;
   enum TType type;
   struct string_view value;
+  int atom;    // Atom id for identifiers and keywords, -1 otherwise
+  int hideset; // Macros it came out of, which may not expand it again
+  _Bool space; // Whitespace came before it
+};
+
+// A token of a macro body or argument. Unlike struct Token it has no
+// location of its own: tokens coming out of an expansion take the location
+// of the macro invocation.
+struct MacroToken {
+  struct string_view value;
+  enum TType type;
+  int atom;    // Atom id for identifiers and keywords, -1 otherwise
+  int file_id; // Source whose buffer value points into
+  int param;   // Parameter slot in a macro body, -1 if not a parameter or
+               // VA_OPT_PARAM for __VA_OPT__
+  int hideset; // Of an argument token; 0 in a body
+  _Bool space; // Whitespace came before it
+};
+
+#define VA_OPT_PARAM -2
+
+// Tokens in struct-of-arrays form. A token's text starts offsets[i] bytes
+// into source_get(file_ids[i])->buffer.
+struct TokenStream {
+  enum TType* types;
+  int* file_ids;
+  uint32_t* offsets;
+  uint32_t* lengths;
+  int* lines;
+  int* positions;
+  int* atoms;
+  size_t count;
+  size_t capacity;
 };
 
 void setup_lexer(const char* filename);
+void cleanup_lexer();
+void print_lexer_stats();
 _Bool get_next_token(struct Token* out);
 
+void token_stream_init(struct TokenStream* ts);
+void token_stream_free(struct TokenStream* ts);
+void token_stream_clear(struct TokenStream* ts);
+// Appends up to max_tokens tokens to ts and returns how many were added,
+// which is 0 once the end of the input has been reached.
+size_t lex_tokens(struct TokenStream* ts, size_t max_tokens);
+
 int strviewstrcmp(struct string_view strview, const char* str);
 void print_strview(struct string_view sv);
 
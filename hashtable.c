@@ -3,218 +3,373 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#define TABLE_MAX_LOAD 0.75
-
-#define table_capacity(t) ((struct HashTableHeader*)(t) - 1)->capacity
-#define table_filled(t)   ((struct HashTableHeader*)(t) - 1)->filled
-
-static PreprocessorTable preproc_table_create_with_capacity(uint64_t capacity) {
-  PreprocessorTable t = (void*)(
-    (struct HashTableHeader*)malloc(sizeof(struct HashTableHeader)
-                                    + capacity*sizeof(struct KeyValueStrView))
-     + 1);
-
-  memset(t, 0, capacity*sizeof(struct KeyValueStrView));
-
-  table_capacity(t) = capacity;
-  table_filled(t)   = 0;
-
-  return t;
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#else
+#include "scan.h"
+#endif
+
+// Swiss table. ctrl holds one byte per slot: CTRL_EMPTY, CTRL_DELETED, or
+// for a full slot the top 7 bits of its hash. A lookup compares a whole
+// group of MAP_GROUP control bytes against those 7 bits at once and only
+// visits the slots that match, where the stored hash is compared before the
+// key. The first group is mirrored after the last control byte so that a
+// group can be loaded starting at any slot.
+#define MAP_GROUP 16
+#define CTRL_EMPTY   ((uint8_t)0x80)
+#define CTRL_DELETED ((uint8_t)0xFE)
+
+#define map_max_load(capacity) ((capacity) - (capacity) / 8)
+
+struct MapSlot {
+  uint64_t hash;
+  struct string_view key;
+  // Followed by the value, value_size bytes rounded up to 8
+};
+
+static inline uint8_t hash_h2(uint64_t hash)
+{
+  return (uint8_t)(hash >> 57);
 }
 
-static MacroTable macro_table_create_with_capacity(uint64_t capacity) {
-  MacroTable t = (void*)(
-   (struct HashTableHeader*)malloc(sizeof(struct HashTableHeader) 
-                                   + capacity*sizeof(struct KeyValueMacro)) 
-   + 1);
-
-  memset(t, 0, capacity*sizeof(struct KeyValueMacro));
+static inline struct MapSlot* map_slot(const struct HashMap* map, size_t i)
+{
+  return (struct MapSlot*)(map->slots + i * map->slot_size);
+}
 
-  table_capacity(t) = capacity;
-  table_filled(t)   = 0;
+static inline void* slot_value(struct MapSlot* slot)
+{
+  return slot + 1;
+}
 
-  return t;
+#if !defined(__SSE2__)
+// Packs the high bit of each byte of a SWAR mask into bit i for byte i.
+static inline uint32_t swar_bits(uint64_t mask)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  mask = __builtin_bswap64(mask);
+#endif
+  return (uint32_t)(((mask >> 7) * 0x0102040810204080ull) >> 56);
 }
+#endif
 
-PreprocessorTable preproc_table_create() {
-  return preproc_table_create_with_capacity(16);
+// Bit i of the result is set if byte i of the group equals c.
+static inline uint32_t group_match(const uint8_t* group, uint8_t c)
+{
+#if defined(__SSE2__)
+  __m128i g = _mm_loadu_si128((const __m128i*)group);
+  __m128i eq = _mm_cmpeq_epi8(g, _mm_set1_epi8((char)c));
+  return (uint32_t)_mm_movemask_epi8(eq);
+#else
+  const char* p = (const char*)group;
+  return swar_bits(swar_eq(swar_load(p), (char)c))
+       | swar_bits(swar_eq(swar_load(p + 8), (char)c)) << 8;
+#endif
 }
 
-MacroTable macro_table_create() {
-  return macro_table_create_with_capacity(16);
+// Bit i of the result is set if slot i of the group is empty or deleted.
+static inline uint32_t group_match_free(const uint8_t* group)
+{
+#if defined(__SSE2__)
+  return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+#else
+  const char* p = (const char*)group;
+  return swar_bits(swar_load(p) & SWAR_HIGH)
+       | swar_bits(swar_load(p + 8) & SWAR_HIGH) << 8;
+#endif
 }
 
-void preproc_table_destroy(PreprocessorTable t) {
-  free((struct HashTableHeader*)t - 1);
+static inline void set_ctrl(struct HashMap* map, size_t i, uint8_t c)
+{
+  map->ctrl[i] = c;
+  if(i < MAP_GROUP) map->ctrl[map->capacity + i] = c;
 }
 
-void macro_table_destroy(MacroTable t) {
-  for(uint64_t i = 0; i < table_capacity(t); i++) {
-    struct KeyValueMacro* entry = &t[i];
-    if(entry->value.arg_names == NULL) continue;
-    array_free(entry->value.arg_names);
+// Slots and control bytes share one allocation, slots first. One more slot
+// than the capacity is allocated, for map_rehash_in_place to swap through.
+static void map_allocate(struct HashMap* map, size_t capacity)
+{
+  map->capacity = capacity;
+  map->slots = malloc((capacity + 1) * map->slot_size + capacity + MAP_GROUP);
+  if(!map->slots) {
+    fprintf(stderr, "Failed to allocate hash map of %zu slots.\n", capacity);
+    abort();
   }
+  map->ctrl = (uint8_t*)map->slots + (capacity + 1) * map->slot_size;
+  memset(map->ctrl, CTRL_EMPTY, capacity + MAP_GROUP);
+}
 
-  free((struct HashTableHeader*)t - 1);
+void map_init(struct HashMap* map, size_t value_size)
+{
+  map->value_size = value_size;
+  map->slot_size = sizeof(struct MapSlot) + ((value_size + 7) & ~(size_t)7);
+  map->count = 0;
+  map->tombstones = 0;
+  map_allocate(map, MAP_GROUP);
 }
 
-static struct KeyValueStrView*
-find_entry(PreprocessorTable t, struct string_view key)
+void map_free(struct HashMap* map)
 {
-  uint64_t index = strview_hash(key) & (table_capacity(t)-1);
-  struct KeyValueStrView* tombstone = NULL;
-  while(true) {
-    struct KeyValueStrView* entry = &t[index];
-    if(entry->key.begin == NULL) {
-      if(entry->key.length == 0) { // Empty entry
-        return tombstone != NULL ? tombstone : entry;
-      } else { // Found tombstone
-        if(tombstone == NULL) tombstone = entry;
-      }
-    } else if(!strviewcmp(entry->key, key)) {
-      return entry;
-    }
-    index = (index + 1) & (table_capacity(t) - 1);
-  }
+  free(map->slots);
+  map->slots = NULL;
+  map->ctrl = NULL;
+  map->capacity = 0;
+  map->count = 0;
+  map->tombstones = 0;
 }
 
-static struct KeyValueMacro*
-macro_table_find_entry(MacroTable t, struct string_view key)
-{
-  uint64_t index = strview_hash(key) & (table_capacity(t)-1);
-  struct KeyValueMacro* tombstone = NULL;
-  while(true) {
-    struct KeyValueMacro* entry = &t[index];
-    if(entry->key.begin == NULL) {
-      if(entry->key.length == 0) { // Empty entry
-        return tombstone != NULL ? tombstone : entry;
-      } else { // Found tombstone
-        if(tombstone == NULL) tombstone = entry;
-      }
-    } else if(!strviewcmp(entry->key, key)) {
-      return entry;
+// Groups are probed triangularly, which visits every group once the
+// capacity is a power of two.
+static size_t find_index(const struct HashMap* map, struct string_view key,
+                         uint64_t hash)
+{
+  size_t mask = map->capacity - 1;
+  size_t pos = (size_t)hash & mask;
+  size_t stride = 0;
+  uint8_t h2 = hash_h2(hash);
+  for(;;) {
+    const uint8_t* group = map->ctrl + pos;
+    for(uint32_t m = group_match(group, h2); m; m &= m - 1) {
+      size_t i = (pos + (size_t)__builtin_ctz(m)) & mask;
+      struct MapSlot* slot = map_slot(map, i);
+      if(slot->hash == hash && slot->key.length == key.length
+         && !memcmp(slot->key.begin, key.begin, key.length)) return i;
     }
-    index = (index + 1) & (table_capacity(t) - 1);
+    if(group_match(group, CTRL_EMPTY)) return SIZE_MAX;
+    stride += MAP_GROUP;
+    pos = (pos + stride) & mask;
   }
 }
 
-struct string_view preproc_table_get(PreprocessorTable t,
-                                     struct string_view key) {
-  if(table_filled(t) == 0) return (struct string_view){.begin=NULL, .length=0}; 
-
-  struct KeyValueStrView *entry = find_entry(t, key);
-  if(entry == NULL) return (struct string_view){.begin=NULL, .length=0};
-
-  return entry->value;
+// First empty or deleted slot on the probe sequence of hash.
+static size_t find_free(const struct HashMap* map, uint64_t hash)
+{
+  size_t mask = map->capacity - 1;
+  size_t pos = (size_t)hash & mask;
+  size_t stride = 0;
+  for(;;) {
+    uint32_t m = group_match_free(map->ctrl + pos);
+    if(m) return (pos + (size_t)__builtin_ctz(m)) & mask;
+    stride += MAP_GROUP;
+    pos = (pos + stride) & mask;
+  }
 }
 
-struct Macro macro_table_get(MacroTable t, struct string_view key) {
-  struct Macro null_macro = { .text = {0}, .arg_names = NULL };
-  if(table_filled(t) == 0) return null_macro; 
+// Entries are moved with memcpy; values never point into their own slot.
+static void map_resize(struct HashMap* map, size_t capacity)
+{
+  struct HashMap old = *map;
+  map_allocate(map, capacity);
+  for(size_t i = 0; i < old.capacity; i++) {
+    if(old.ctrl[i] & 0x80) continue;
+    struct MapSlot* slot = map_slot(&old, i);
+    size_t j = find_free(map, slot->hash);
+    set_ctrl(map, j, old.ctrl[i]);
+    memcpy(map_slot(map, j), slot, map->slot_size);
+  }
+  map->tombstones = 0;
+  free(old.slots);
+}
 
-  struct KeyValueMacro *entry = macro_table_find_entry(t, key);
-  if(entry == NULL) return null_macro;
+// Index of the group slot i is in on the probe sequence of hash.
+static inline size_t probe_group(const struct HashMap* map, uint64_t hash,
+                                 size_t i)
+{
+  return ((i - (size_t)hash) & (map->capacity - 1)) / MAP_GROUP;
+}
 
-  return entry->value;
+// Clears the tombstones without reallocating. Full slots are first marked
+// deleted, then each is moved to the first free slot on its probe sequence:
+// left where it is if that is in the same group, moved if the target is
+// empty, or swapped with the target if that is still to be placed, in
+// which case the slot swapped in is placed next.
+static void map_rehash_in_place(struct HashMap* map)
+{
+  for(size_t i = 0; i < map->capacity; i++) {
+    map->ctrl[i] = map->ctrl[i] & 0x80 ? CTRL_EMPTY : CTRL_DELETED;
+  }
+  memcpy(map->ctrl + map->capacity, map->ctrl, MAP_GROUP);
+
+  char* tmp = map->slots + map->capacity * map->slot_size;
+  for(size_t i = 0; i < map->capacity; i++) {
+    if(map->ctrl[i] != CTRL_DELETED) continue;
+    struct MapSlot* slot = map_slot(map, i);
+    size_t j = find_free(map, slot->hash);
+    if(probe_group(map, slot->hash, i) == probe_group(map, slot->hash, j)) {
+      set_ctrl(map, i, hash_h2(slot->hash));
+      continue;
+    }
+    struct MapSlot* target = map_slot(map, j);
+    if(map->ctrl[j] == CTRL_EMPTY) {
+      set_ctrl(map, j, hash_h2(slot->hash));
+      memcpy(target, slot, map->slot_size);
+      set_ctrl(map, i, CTRL_EMPTY);
+    } else {
+      set_ctrl(map, j, hash_h2(slot->hash));
+      memcpy(tmp, target, map->slot_size);
+      memcpy(target, slot, map->slot_size);
+      memcpy(slot, tmp, map->slot_size);
+      i--;
+    }
+  }
+  map->tombstones = 0;
 }
 
-static void adjust_capacity(PreprocessorTable* t, uint64_t capacity) {
-  PreprocessorTable newT = preproc_table_create_with_capacity(capacity);
-  
-  for(uint64_t i = 0; i < table_capacity(*t); i++) {
-    struct KeyValueStrView* entry = &(*t)[i];
-    if(entry->key.begin == NULL) continue;
+// Makes room for one more entry. Tombstones are cleared in place while the
+// live entries would fill at most half of the table; otherwise it doubles.
+static void map_reserve_one(struct HashMap* map)
+{
+  size_t max_load = map_max_load(map->capacity);
+  if(map->count + map->tombstones + 1 <= max_load) return;
 
-    struct KeyValueStrView* dst = find_entry(newT, entry->key);
-    dst->key = entry->key;
-    dst->value = entry->value;
-    table_filled(newT)++;
+  if(2 * (map->count + 1) <= max_load) {
+    map_rehash_in_place(map);
+  } else {
+    map_resize(map, 2 * map->capacity);
   }
+}
 
-  preproc_table_destroy(*t);
-  *t = newT;
+void* map_find(const struct HashMap* map, struct string_view key,
+               uint64_t hash)
+{
+  size_t i = find_index(map, key, hash);
+  return i == SIZE_MAX ? NULL : slot_value(map_slot(map, i));
 }
 
-static void macro_table_adjust_capacity(MacroTable* t, uint64_t capacity) {
-  MacroTable newT = macro_table_create_with_capacity(capacity);
-  
-  for(uint64_t i = 0; i < table_capacity(*t); i++) {
-    struct KeyValueMacro* entry = &(*t)[i];
-    if(entry->key.begin == NULL) continue;
+// Returns the value for key, adding a zeroed one if it was not in the map.
+void* map_insert(struct HashMap* map, struct string_view key, uint64_t hash,
+                 bool* is_new)
+{
+  size_t i = find_index(map, key, hash);
+  if(is_new) *is_new = i == SIZE_MAX;
+  if(i != SIZE_MAX) return slot_value(map_slot(map, i));
+
+  map_reserve_one(map);
+  i = find_free(map, hash);
+  if(map->ctrl[i] == CTRL_DELETED) map->tombstones--;
+  map->count++;
+  set_ctrl(map, i, hash_h2(hash));
+
+  struct MapSlot* slot = map_slot(map, i);
+  slot->hash = hash;
+  slot->key = key;
+  memset(slot_value(slot), 0, map->value_size);
+  return slot_value(slot);
+}
 
-    struct KeyValueMacro* dst = macro_table_find_entry(newT, entry->key);
-    dst->key = entry->key;
-    dst->value = macro_copy(entry->value);
-    table_filled(newT)++;
+// Copies the removed value to value if it is not NULL. A slot only needs a
+// tombstone if some group containing it could have been full when a key
+// probed past it, which is not the case if there are empty slots less than
+// a group apart on either side of it. The table halves once it is less
+// than an eighth full.
+bool map_remove(struct HashMap* map, struct string_view key, uint64_t hash,
+                void* value)
+{
+  size_t i = find_index(map, key, hash);
+  if(i == SIZE_MAX) return false;
+
+  struct MapSlot* slot = map_slot(map, i);
+  if(value) memcpy(value, slot_value(slot), map->value_size);
+
+  size_t before = (i - MAP_GROUP) & (map->capacity - 1);
+  uint32_t empty_before = group_match(map->ctrl + before, CTRL_EMPTY);
+  uint32_t empty_after = group_match(map->ctrl + i, CTRL_EMPTY);
+  if(empty_before && empty_after
+     && (size_t)__builtin_ctz(empty_after)
+        + (size_t)__builtin_clz(empty_before << 16) < MAP_GROUP) {
+    set_ctrl(map, i, CTRL_EMPTY);
+  } else {
+    set_ctrl(map, i, CTRL_DELETED);
+    map->tombstones++;
   }
+  map->count--;
 
-  macro_table_destroy(*t);
-  *t = newT;
+  if(map->capacity > MAP_GROUP && map->count < map->capacity / 8) {
+    map_resize(map, map->capacity / 2);
+  }
+  return true;
 }
 
-_Bool preproc_table_set(PreprocessorTable* t,
-                        struct string_view key,
-                        struct string_view value) {
-  if(table_filled(*t) + 1 > (double)table_capacity(*t) * TABLE_MAX_LOAD) {
-    uint64_t capacity = 2 * table_capacity(*t);
-    adjust_capacity(t, capacity); 
+void map_stats(const struct HashMap* map, struct MapStats* stats)
+{
+  *stats = (struct MapStats){
+    .count = map->count,
+    .tombstones = map->tombstones,
+    .capacity = map->capacity,
+    .bytes = map->capacity * (map->slot_size + 1) + map->slot_size + MAP_GROUP
+  };
+  size_t total = 0;
+  for(size_t i = 0; i < map->capacity; i++) {
+    if(map->ctrl[i] & 0x80) continue;
+    size_t groups = probe_group(map, map_slot(map, i)->hash, i) + 1;
+    total += groups;
+    if(groups > stats->max_probe) stats->max_probe = groups;
   }
-
-  struct KeyValueStrView *entry = find_entry(*t, key);
-  bool isNewKey = entry->key.begin == NULL;
-  if(isNewKey) table_filled(*t)++;
-
-  entry->key = key;
-  entry->value = value;
-  return isNewKey;
+  stats->mean_probe = map->count ? (double)total / (double)map->count : 0;
 }
 
-bool macro_table_set(MacroTable* t, struct string_view key,
-                     struct Macro value) {
-  if(table_filled(*t) + 1 > (double)table_capacity(*t) * TABLE_MAX_LOAD) {
-    uint64_t capacity = 2 * table_capacity(*t);
-    macro_table_adjust_capacity(t, capacity); 
+// Iterates over the map: start with *index at 0 and call until it returns
+// NULL. The map must not be changed in between.
+void* map_next(const struct HashMap* map, size_t* index,
+               struct string_view* key)
+{
+  for(size_t i = *index; i < map->capacity; i++) {
+    if(map->ctrl[i] & 0x80) continue;
+    struct MapSlot* slot = map_slot(map, i);
+    if(key) *key = slot->key;
+    *index = i + 1;
+    return slot_value(slot);
   }
+  *index = map->capacity;
+  return NULL;
+}
 
-  struct KeyValueMacro *entry = macro_table_find_entry(*t, key);
-  bool isNewKey = entry->key.begin == NULL;
-  if(isNewKey) table_filled(*t)++;
-
-  if(!isNewKey && !entry->value.arg_names) array_free(entry->value.arg_names);
+void macro_table_init(MacroTable* t)
+{
+  map_init(t, sizeof(struct Macro));
+}
 
-  entry->key = key;
-  entry->value = macro_copy(value);
-  return isNewKey;
+void macro_table_destroy(MacroTable* t)
+{
+  size_t i = 0;
+  struct Macro* macro;
+  while((macro = map_next(t, &i, NULL))) {
+    if(macro->body) array_free(macro->body);
+    if(macro->params) array_free(macro->params);
+  }
+  map_free(t);
 }
 
-_Bool preproc_table_delete(PreprocessorTable* t,
-                           struct string_view key) {
-  if(table_filled(*t) == 0) return false;
+struct Macro* macro_table_get(const MacroTable* t, struct string_view key,
+                              uint64_t hash)
+{
+  return map_find(t, key, hash);
+}
 
-  struct KeyValueStrView* entry = find_entry(*t, key);
-  if(entry->key.begin == NULL) return false;
+bool macro_table_set(MacroTable* t, struct string_view key, uint64_t hash,
+                     struct Macro value)
+{
+  bool is_new;
+  struct Macro* entry = map_insert(t, key, hash, &is_new);
+  if(!is_new) {
+    if(entry->body) array_free(entry->body);
+    if(entry->params) array_free(entry->params);
+  }
 
-  entry->key.begin = NULL;
-  entry->key.length = 1; // Tombstone
-  entry->value = (struct string_view){ .begin = NULL, .length = 0 };
-  return true;
+  *entry = value;
+  return is_new;
 }
 
-bool macro_table_delete(MacroTable* t, struct string_view key) {
-  if(table_filled(*t) == 0) return false;
-
-  struct KeyValueMacro* entry = macro_table_find_entry(*t, key);
-  if(entry->key.begin == NULL) return false;
+bool macro_table_delete(MacroTable* t, struct string_view key, uint64_t hash)
+{
+  struct Macro removed;
+  if(!map_remove(t, key, hash, &removed)) return false;
 
-  entry->key.begin = NULL;
-  entry->key.length = 1; // Tombstone
-  array_free(entry->value.arg_names);
-  entry->value = (struct Macro){0};
+  if(removed.body) array_free(removed.body);
+  if(removed.params) array_free(removed.params);
   return true;
 }
-
-
-
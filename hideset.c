@@ -0,0 +1,254 @@
+#include "compiler.h"
+#include "array.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A hide set is a sorted array of atom ids. Every distinct set is interned
+// once and referred to by its id, so a token carries a single int and the
+// result of an operation on two sets can be cached by their ids. Id 0 is
+// the empty set.
+struct HideSet {
+  const int* atoms;
+  size_t count;
+  uint64_t bloom;  // Bit atom % 64 is set for every member
+  int added_atom;  // The last atom added to this set
+  int added_set;   // and the set that made, or -1
+};
+
+static struct Arena hideset_arena;
+static struct HashMap hideset_map; // Members, as bytes, to id
+static Array(struct HideSet) hideset_list;
+static Array(int) hideset_scratch;
+
+enum HideSetOp {
+  HS_ADD = 1,
+  HS_UNION,
+  HS_INTERSECT,
+  HS_CONTAINS
+};
+
+// Results of operations already done, in an open-addressing table that is
+// never evicted from. Expansions apply the same few operations to the same
+// sets over and over, so most are hits, and a long chain of nested
+// expansions that makes a new set at every level only does so once.
+#define HS_CACHE_MIN 4096
+
+struct HideSetCacheEntry {
+  int op;
+  int a;
+  int b;
+  int result;
+};
+
+static struct HideSetCacheEntry* hideset_cache; // op 0 marks a free entry
+static size_t cache_size;
+static size_t cache_count;
+static unsigned long cache_hits;
+static unsigned long cache_misses;
+
+static int hideset_intern(const int* atoms, size_t count)
+{
+  struct string_view key = { .begin = (char*)atoms,
+                             .length = count * sizeof(int) };
+  uint64_t hash = strview_hash(key);
+  int* found = map_find(&hideset_map, key, hash);
+  if(found) return *found;
+
+  // The members are usually in hideset_scratch, so they are copied before
+  // the map keeps a view of them. The spare slot gives even the empty set
+  // a real pointer.
+  int* stored = arena_alloc(&hideset_arena, (count + 1) * sizeof(int));
+  memcpy(stored, atoms, count * sizeof(int));
+  key.begin = (char*)stored;
+  int id = (int)array_length(hideset_list);
+  *(int*)map_insert(&hideset_map, key, hash, NULL) = id;
+  if(array_length(hideset_list) >= array_capacity(hideset_list)) {
+    array_ensure(&hideset_list, 2 * array_capacity(hideset_list));
+  }
+  uint64_t bloom = 0;
+  for(size_t i = 0; i < count; i++) bloom |= 1ull << (atoms[i] & 63);
+  hideset_list[array_length(hideset_list)++] =
+      (struct HideSet){ .atoms = stored, .count = count, .bloom = bloom,
+                        .added_set = -1 };
+  return id;
+}
+
+static void scratch_reserve(size_t count)
+{
+  if(count > array_capacity(hideset_scratch)) {
+    array_ensure(&hideset_scratch, 2 * count);
+  }
+}
+
+// Finds the entry for the operation, or the free entry where it belongs.
+static inline struct HideSetCacheEntry* cache_entry(int op, int a, int b)
+{
+  uint64_t h = ((uint64_t)(uint32_t)a << 32 | (uint32_t)b) * 0x9e3779b97f4a7c15
+               ^ (uint64_t)op;
+  size_t i = (size_t)(h >> 32) & (cache_size - 1);
+  for(;; i = (i + 1) & (cache_size - 1)) {
+    struct HideSetCacheEntry* entry = &hideset_cache[i];
+    if(!entry->op || (entry->op == op && entry->a == a && entry->b == b)) {
+      return entry;
+    }
+  }
+}
+
+static void cache_resize(size_t size)
+{
+  struct HideSetCacheEntry* old = hideset_cache;
+  size_t old_size = cache_size;
+  hideset_cache = calloc(size, sizeof(struct HideSetCacheEntry));
+  if(!hideset_cache) {
+    fprintf(stderr, "Failed to allocate hide set cache of %zu entries.\n", size);
+    abort();
+  }
+  cache_size = size;
+  for(size_t i = 0; i < old_size; i++) {
+    if(!old[i].op) continue;
+    *cache_entry(old[i].op, old[i].a, old[i].b) = old[i];
+  }
+  free(old);
+}
+
+void hidesets_init()
+{
+  arena_init(&hideset_arena, 1 << 14);
+  map_init(&hideset_map, sizeof(int));
+  array_new_capacity(&hideset_list, 64);
+  array_new_capacity(&hideset_scratch, 64);
+  cache_resize(HS_CACHE_MIN);
+  cache_count = 0;
+  cache_hits = 0;
+  cache_misses = 0;
+  hideset_intern(hideset_scratch, 0);
+}
+
+void hidesets_free()
+{
+  arena_free(&hideset_arena);
+  map_free(&hideset_map);
+  array_free(hideset_list);
+  array_free(hideset_scratch);
+  free(hideset_cache);
+  hideset_cache = NULL;
+  cache_size = 0;
+  hideset_list = NULL;
+  hideset_scratch = NULL;
+}
+
+static int compute(int op, int a, int b)
+{
+  struct HideSet x = hideset_list[a];
+  size_t i = 0, j = 0, n = 0;
+
+  switch(op) {
+  case HS_CONTAINS: {
+    size_t lo = 0, hi = x.count;
+    while(lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      if(x.atoms[mid] < b) lo = mid + 1;
+      else hi = mid;
+    }
+    return lo < x.count && x.atoms[lo] == b;
+  }
+  case HS_ADD:
+    scratch_reserve(x.count + 1);
+    while(i < x.count && x.atoms[i] < b) hideset_scratch[n++] = x.atoms[i++];
+    if(i < x.count && x.atoms[i] == b) return a;
+    hideset_scratch[n++] = b;
+    while(i < x.count) hideset_scratch[n++] = x.atoms[i++];
+    break;
+  case HS_UNION: {
+    struct HideSet y = hideset_list[b];
+    scratch_reserve(x.count + y.count);
+    while(i < x.count && j < y.count) {
+      if(x.atoms[i] < y.atoms[j]) hideset_scratch[n++] = x.atoms[i++];
+      else if(y.atoms[j] < x.atoms[i]) hideset_scratch[n++] = y.atoms[j++];
+      else {
+        hideset_scratch[n++] = x.atoms[i++];
+        j++;
+      }
+    }
+    while(i < x.count) hideset_scratch[n++] = x.atoms[i++];
+    while(j < y.count) hideset_scratch[n++] = y.atoms[j++];
+    break;
+  }
+  case HS_INTERSECT: {
+    struct HideSet y = hideset_list[b];
+    scratch_reserve(x.count < y.count ? x.count : y.count);
+    while(i < x.count && j < y.count) {
+      if(x.atoms[i] < y.atoms[j]) i++;
+      else if(y.atoms[j] < x.atoms[i]) j++;
+      else {
+        hideset_scratch[n++] = x.atoms[i++];
+        j++;
+      }
+    }
+    break;
+  }
+  }
+  return hideset_intern(hideset_scratch, n);
+}
+
+static inline int cached(int op, int a, int b)
+{
+  struct HideSetCacheEntry* entry = cache_entry(op, a, b);
+  if(entry->op) {
+    cache_hits++;
+    return entry->result;
+  }
+  cache_misses++;
+  int result = compute(op, a, b);
+  *entry = (struct HideSetCacheEntry){ .op = op, .a = a, .b = b,
+                                       .result = result };
+  if(++cache_count > cache_size / 2) cache_resize(2 * cache_size);
+  return result;
+}
+
+// An expansion adds its macro to the hide set of the name, which is
+// usually the same set as the last time, so that is checked first.
+int hideset_add(int set, int atom)
+{
+  struct HideSet* x = &hideset_list[set];
+  if(x->added_atom == atom && x->added_set >= 0) return x->added_set;
+  int result = cached(HS_ADD, set, atom);
+  x = &hideset_list[set]; // Making the set may have moved the list
+  x->added_atom = atom;
+  x->added_set = result;
+  return result;
+}
+
+int hideset_union(int a, int b)
+{
+  if(a == b || b == 0) return a;
+  if(a == 0) return b;
+  return a < b ? cached(HS_UNION, a, b) : cached(HS_UNION, b, a);
+}
+
+int hideset_intersect(int a, int b)
+{
+  if(a == b) return a;
+  if(a == 0 || b == 0) return 0;
+  return a < b ? cached(HS_INTERSECT, a, b) : cached(HS_INTERSECT, b, a);
+}
+
+// Most names are not in their hide set, which the bloom filter usually
+// shows without a lookup.
+bool hideset_contains(int set, int atom)
+{
+  if(!(hideset_list[set].bloom & 1ull << (atom & 63))) return false;
+  return cached(HS_CONTAINS, set, atom);
+}
+
+void hideset_stats(struct HideSetStats* stats)
+{
+  *stats = (struct HideSetStats){
+    .sets = array_length(hideset_list),
+    .cache_hits = cache_hits,
+    .cache_misses = cache_misses
+  };
+}
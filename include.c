@@ -0,0 +1,358 @@
+#include "compiler.h"
+#include "array.h"
+
+#include <dirent.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// Finds the files #include names without probing the file system for each
+// one. The first lookup in a directory lists it, and every entry is kept
+// under its path, so whether a candidate exists is a hash lookup from then
+// on. On top of that, the result of resolving each spelling from each
+// including directory is remembered, whether a file was found or not, so
+// including the same header again costs a single lookup.
+//
+// #include_next goes on with the search after the directory the including
+// file was found in, so which one that was is kept for every file.
+//
+// With --prefetch, when a file starts being read, the files its #include
+// directives name are resolved ahead of time and handed to the prefetcher,
+// which reads them into the page cache in the background.
+
+enum EntryKind {
+  ENTRY_FILE,      // Or anything else that is not a directory
+  ENTRY_DIRECTORY
+};
+
+static struct Arena include_arena;     // Keys of the maps below
+static Array(const char*) include_dirs = NULL;
+static struct HashMap dir_entries;     // Path to enum EntryKind
+static struct HashMap listed_dirs;     // Directory to whether it opened
+static struct HashMap resolved;        // Spelling to file id, -1 if missing
+static struct HashMap prefetched;      // Spellings asked for in advance, to
+                                       // the prefetch index or -1
+static Array(char) scratch_path = NULL;
+static Array(int) file_dirs = NULL;    // By file id, the index in
+                                       // include_dirs it was found in or -1
+static struct IncludeStats stats;
+
+void add_include_dir(const char* dir)
+{
+  if(!include_dirs) array_new_capacity(&include_dirs, 8);
+  if(array_length(include_dirs) >= array_capacity(include_dirs)) {
+    array_ensure(&include_dirs, 2 * array_capacity(include_dirs));
+  }
+  include_dirs[array_length(include_dirs)++] = dir;
+}
+
+void include_init()
+{
+  add_include_dir("/usr/local/include");
+  add_include_dir("/usr/include");
+  arena_init(&include_arena, 1 << 14);
+  map_init(&dir_entries, sizeof(enum EntryKind));
+  map_init(&listed_dirs, sizeof(bool));
+  map_init(&resolved, sizeof(int));
+  map_init(&prefetched, sizeof(long));
+  array_new_capacity(&scratch_path, 256);
+  array_new_capacity(&file_dirs, 64);
+  stats = (struct IncludeStats){0};
+  prefetch_start();
+}
+
+void include_free()
+{
+  prefetch_stop();
+  array_free(include_dirs);
+  array_free(scratch_path);
+  array_free(file_dirs);
+  include_dirs = NULL;
+  scratch_path = NULL;
+  file_dirs = NULL;
+  map_free(&dir_entries);
+  map_free(&listed_dirs);
+  map_free(&resolved);
+  map_free(&prefetched);
+  arena_free(&include_arena);
+}
+
+void include_stats(struct IncludeStats* out)
+{
+  *out = stats;
+}
+
+static void scratch_append(const char* str, size_t length)
+{
+  size_t needed = array_length(scratch_path) + length + 1;
+  if(needed > array_capacity(scratch_path)) {
+    size_t capacity = array_capacity(scratch_path);
+    while(capacity < needed) capacity *= 2;
+    array_ensure(&scratch_path, capacity);
+  }
+  memcpy(scratch_path + array_length(scratch_path), str, length);
+  array_length(scratch_path) += length;
+  scratch_path[array_length(scratch_path)] = '\0';
+}
+
+// Removes the "." components of a path in place, so that the spellings
+// of a file that only differ by them find the same source. Returns the
+// new length.
+static size_t remove_dot_components(char* path)
+{
+  char* out = path;
+  const char* in = path;
+  while(*in) {
+    bool at_start = in == path || in[-1] == '/';
+    if(at_start && in[0] == '.' && (in[1] == '/' || !in[1])) {
+      in += in[1] ? 2 : 1;
+      continue;
+    }
+    *out++ = *in++;
+  }
+  if(out > path + 1 && out[-1] == '/') out--;
+  *out = '\0';
+  return (size_t)(out - path);
+}
+
+// Symlinks, and entries on file systems that do not report a type, are
+// looked at with fstatat to find what they are.
+static enum EntryKind entry_kind(DIR* handle, const struct dirent* entry)
+{
+  if(entry->d_type == DT_DIR) return ENTRY_DIRECTORY;
+  if(entry->d_type != DT_UNKNOWN && entry->d_type != DT_LNK) return ENTRY_FILE;
+  struct stat st;
+  stats.entries_stated++;
+  if(fstatat(dirfd(handle), entry->d_name, &st, 0)) return ENTRY_FILE;
+  return S_ISDIR(st.st_mode) ? ENTRY_DIRECTORY : ENTRY_FILE;
+}
+
+// Reads the entries of dir into dir_entries, each under the path it is
+// looked up by: dir/name, or just name in the current directory.
+static void list_dir(struct string_view dir)
+{
+  char* key = arena_strndup(&include_arena, dir.begin, dir.length);
+  bool is_new;
+  bool* opened = map_insert(&listed_dirs,
+                            (struct string_view){ key, dir.length },
+                            strview_hash(dir), &is_new);
+  stats.dirs_listed++;
+  DIR* handle = opendir(dir.length ? key : ".");
+  *opened = handle != NULL;
+  if(!handle) return;
+
+  struct dirent* entry;
+  while((entry = readdir(handle))) {
+    if(entry->d_name[0] == '.' && (!entry->d_name[1]
+       || (entry->d_name[1] == '.' && !entry->d_name[2]))) {
+      continue;
+    }
+    size_t name_length = strlen(entry->d_name);
+    bool slash = dir.length && !(dir.length == 1 && dir.begin[0] == '/');
+    size_t length = dir.length + slash + name_length;
+    char* path = arena_alloc(&include_arena, length + 1);
+    memcpy(path, dir.begin, dir.length);
+    if(slash) path[dir.length] = '/';
+    memcpy(path + dir.length + slash, entry->d_name, name_length + 1);
+    struct string_view sv = { path, length };
+    enum EntryKind* kind = map_insert(&dir_entries, sv, strview_hash(sv),
+                                      &is_new);
+    *kind = entry_kind(handle, entry);
+    stats.entries++;
+  }
+  closedir(handle);
+}
+
+// Returns whether path names something that may be a file, listing the
+// directory it is in if that has not been done yet.
+static bool file_exists(const char* path, size_t length)
+{
+  size_t slash = length;
+  while(slash && path[slash - 1] != '/') slash--;
+  struct string_view dir = { (char*)path, 0 };
+  if(slash) dir.length = slash == 1 ? 1 : slash - 1;
+  if(!map_find(&listed_dirs, dir, strview_hash(dir))) list_dir(dir);
+
+  struct string_view sv = { (char*)path, length };
+  const enum EntryKind* kind = map_find(&dir_entries, sv, strview_hash(sv));
+  return kind && *kind == ENTRY_FILE;
+}
+
+// Builds dir/name in scratch_path and returns whether it is a file.
+static bool try_path(const char* dir, size_t dir_length,
+                     struct string_view name)
+{
+  array_length(scratch_path) = 0;
+  if(dir_length) {
+    scratch_append(dir, dir_length);
+    scratch_append("/", 1);
+  }
+  scratch_append(name.begin, name.length);
+  size_t length = remove_dot_components(scratch_path);
+  return length && file_exists(scratch_path, length);
+}
+
+// Leaves the path of the file an #include names in scratch_path and
+// returns whether there is one, with the index in include_dirs it was found
+// in, or -1, in dir. The search of include_dirs starts at first_dir.
+static bool resolve_path(struct string_view name, bool quoted,
+                         const char* includer_name, size_t dir_length,
+                         size_t first_dir, int* dir)
+{
+  *dir = -1;
+  if(name.begin[0] == '/') return try_path(NULL, 0, name);
+  if(quoted && try_path(includer_name, dir_length, name)) return true;
+  for(size_t i = first_dir; i < array_length(include_dirs); i++) {
+    if(try_path(include_dirs[i], strlen(include_dirs[i]), name)) {
+      *dir = (int)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Builds in scratch_path what the resolution of an #include is remembered
+// under. The "" form is looked up from the directory of the including file
+// first, so that is part of it, and where the search of include_dirs starts
+// for #include_next. Returns the length of the including file's directory.
+static size_t resolution_key(struct string_view name, bool quoted,
+                             const char* includer_name, size_t first_dir)
+{
+  const char* slash = strrchr(includer_name, '/');
+  size_t dir_length = quoted && slash ? (size_t)(slash - includer_name) : 0;
+  array_length(scratch_path) = 0;
+  if(first_dir) {
+    char start[24];
+    int length = snprintf(start, sizeof(start), ">%zu", first_dir);
+    scratch_append(start, (size_t)length);
+  } else {
+    scratch_append(quoted ? "\"" : "<", 1);
+    scratch_append(includer_name, dir_length);
+  }
+  scratch_append("\n", 1);
+  scratch_append(name.begin, name.length);
+  return dir_length;
+}
+
+static int file_dir(int file_id)
+{
+  return (size_t)file_id < array_length(file_dirs) ? file_dirs[file_id] : -1;
+}
+
+// Remembers the first directory of include_dirs a file was found in.
+static void set_file_dir(int file_id, int dir)
+{
+  size_t needed = (size_t)file_id + 1;
+  if(needed > array_capacity(file_dirs)) {
+    size_t capacity = array_capacity(file_dirs);
+    while(capacity < needed) capacity *= 2;
+    array_ensure(&file_dirs, capacity);
+  }
+  while(array_length(file_dirs) < needed) {
+    file_dirs[array_length(file_dirs)++] = -1;
+  }
+  if(file_dirs[file_id] < 0) file_dirs[file_id] = dir;
+}
+
+int include_resolve(struct string_view name, bool quoted, bool next,
+                    int includer, int line)
+{
+  stats.lookups++;
+  const char* includer_name = source_name(includer);
+  // #include_next in a file that was not found in include_dirs searches
+  // all of them, as <name> does
+  size_t first_dir = 0;
+  if(next) {
+    first_dir = (size_t)(file_dir(includer) + 1);
+    quoted = false;
+  }
+  size_t dir_length = resolution_key(name, quoted, includer_name, first_dir);
+  struct string_view key = { scratch_path, array_length(scratch_path) };
+  uint64_t hash = strview_hash(key);
+  int* found = map_find(&resolved, key, hash);
+  if(found) {
+    stats.cache_hits++;
+    return *found;
+  }
+
+  key.begin = arena_strndup(&include_arena, key.begin, key.length);
+  int id = -1;
+  int dir;
+  if(resolve_path(name, quoted, includer_name, dir_length, first_dir, &dir)) {
+    const long* request = map_find(&prefetched, key, hash);
+    if(request && *request >= 0 && prefetch_was_read(*request)
+       && source_find_file(scratch_path) < 0) {
+      stats.prefetched_used++;
+    }
+    id = source_add_file(scratch_path, includer, line);
+    set_file_dir(id, dir);
+  } else {
+    stats.not_found++;
+  }
+  bool is_new;
+  *(int*)map_insert(&resolved, key, hash, &is_new) = id;
+  return id;
+}
+
+bool include_exists(struct string_view name, bool quoted, int includer)
+{
+  const char* includer_name = source_name(includer);
+  size_t dir_length = resolution_key(name, quoted, includer_name, 0);
+  struct string_view key = { scratch_path, array_length(scratch_path) };
+  const int* found = map_find(&resolved, key, strview_hash(key));
+  if(found) return *found >= 0;
+  int dir;
+  return resolve_path(name, quoted, includer_name, dir_length, 0, &dir);
+}
+
+// Asks the prefetcher for the file an #include in includer names, unless
+// it has been resolved or asked for already.
+static void prefetch_spelling(struct string_view name, bool quoted,
+                              int includer)
+{
+  const char* includer_name = source_name(includer);
+  size_t dir_length = resolution_key(name, quoted, includer_name, 0);
+  struct string_view key = { scratch_path, array_length(scratch_path) };
+  uint64_t hash = strview_hash(key);
+  if(map_find(&resolved, key, hash) || map_find(&prefetched, key, hash)) {
+    return;
+  }
+
+  key.begin = arena_strndup(&include_arena, key.begin, key.length);
+  bool is_new;
+  long* request = map_insert(&prefetched, key, hash, &is_new);
+  *request = -1;
+  int dir;
+  if(resolve_path(name, quoted, includer_name, dir_length, 0, &dir)
+     && source_find_file(scratch_path) < 0) {
+    *request = prefetch_file(scratch_path);
+  }
+}
+
+// The scan looks for "#include" followed by a file name anywhere, not only
+// at the start of a line: it is cheap, and a match in a comment or a
+// string only costs reading a file that may not be needed.
+void include_prefetch(int file_id)
+{
+  if(!prefetch_running()) return;
+  const struct SourceFile* source = source_get(file_id);
+  const char* p = source->buffer;
+  const char* end = p + source->size;
+  while((p = memchr(p, '#', (size_t)(end - p)))) {
+    p++;
+    while(p < end && (*p == ' ' || *p == '\t')) p++;
+    if(end - p < 8 || memcmp(p, "include", 7)) continue;
+    p += 7;
+    while(p < end && (*p == ' ' || *p == '\t')) p++;
+    if(p == end || (*p != '"' && *p != '<')) continue;
+    char close = *p == '"' ? '"' : '>';
+    const char* begin = ++p;
+    while(p < end && *p != close && *p != '\n') p++;
+    if(p == end || *p != close || p == begin) continue;
+    prefetch_spelling((struct string_view){ (char*)begin, (size_t)(p - begin) },
+                      close == '"', file_id);
+  }
+}
@@ -1,12 +1,13 @@
 #include "compiler.h"
+#include "scan.h"
 
-#include <ctype.h>
-#include <setjmp.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 struct OperatorTokenPair {
   enum TType single;
@@ -94,26 +95,388 @@ struct KeywordTokenPair {
   {"_Thread_local", _THREAD_LOCAL_TOK}
 };
 
+// Keywords are interned when the lexer is set up, so the atom of an
+// identifier also says whether it is a keyword. They are found without the
+// atom map too, through a perfect hash built from the table above: the key
+// packs the length with the first two and last two characters, and a
+// multiplicative seed is searched for that sends every keyword to its own
+// slot, so telling whether an identifier is one is one probe and one
+// compare.
+#define KEYWORD_MIN_LENGTH 2
+#define KEYWORD_MAX_LENGTH 14
+#define KEYWORD_HASH_BITS 9
+
+static uint64_t keyword_seed;
+static unsigned char keyword_lengths[NUM_KEYWORD];
+static unsigned char keyword_slots[1 << KEYWORD_HASH_BITS]; // keyword index + 1
+static struct Atom* keyword_atoms[NUM_KEYWORD];
+
+static inline uint64_t keyword_key(const char* s, size_t length)
+{
+  return (uint64_t)length
+       | (uint64_t)(unsigned char)s[0] << 8
+       | (uint64_t)(unsigned char)s[1] << 16
+       | (uint64_t)(unsigned char)s[length - 2] << 24
+       | (uint64_t)(unsigned char)s[length - 1] << 32;
+}
+
+static inline unsigned keyword_hash(uint64_t key, uint64_t seed)
+{
+  return (unsigned)((key * seed) >> (64 - KEYWORD_HASH_BITS));
+}
+
+static void keyword_hash_init()
+{
+  uint64_t state = 0x9e3779b97f4a7c15;
+  for(int attempt = 0; attempt < 100000; attempt++) {
+    state += 0x9e3779b97f4a7c15;
+    uint64_t seed = (state ^ (state >> 31)) | 1;
+    memset(keyword_slots, 0, sizeof(keyword_slots));
+
+    bool collision = false;
+    for(int i = 0; i < NUM_KEYWORD && !collision; i++) {
+      size_t length = strlen(keywords[i].keyword);
+      keyword_lengths[i] = (unsigned char)length;
+      unsigned slot = keyword_hash(keyword_key(keywords[i].keyword, length), seed);
+      if(keyword_slots[slot]) collision = true;
+      keyword_slots[slot] = (unsigned char)(i + 1);
+    }
+    if(!collision) {
+      keyword_seed = seed;
+      return;
+    }
+  }
+
+  fprintf(stderr, "Failed to build keyword hash table.\n");
+  abort();
+}
+
+// The atom of sv if it is a keyword, and NULL otherwise.
+static inline struct Atom* keyword_atom(struct string_view sv)
+{
+  if(sv.length < KEYWORD_MIN_LENGTH || sv.length > KEYWORD_MAX_LENGTH)
+    return NULL;
+  unsigned slot = keyword_hash(keyword_key(sv.begin, sv.length), keyword_seed);
+  int index = keyword_slots[slot] - 1;
+  if(index < 0 || keyword_lengths[index] != sv.length
+     || memcmp(keywords[index].keyword, sv.begin, sv.length))
+    return NULL;
+  return keyword_atoms[index];
+}
+
+// The atoms of recent identifiers, in a direct-mapped cache indexed by
+// hash. Most identifiers were seen a few tokens before, and finding them
+// there is one probe and a compare against the spelling the atom holds.
+#define ATOM_CACHE_BITS 12
+
+static struct Atom* atom_cache[1 << ATOM_CACHE_BITS];
+
+// The atom of the identifier or keyword name, whose strview_hash is hash.
+// Keywords are found through their perfect hash, so only other names go to
+// the atom map.
+static inline struct Atom* identifier_atom(struct string_view name,
+                                           uint64_t hash)
+{
+  struct Atom** cached = &atom_cache[hash & ((1 << ATOM_CACHE_BITS) - 1)];
+  struct Atom* atom = *cached;
+  if(atom && atom->hash == hash && atom->name.length == name.length
+     && swar_equal(atom->name.begin, name.begin, name.length)) {
+    return atom;
+  }
+  atom = keyword_atom(name);
+  if(!atom) atom = atom_intern_hashed(name, hash);
+  *cached = atom;
+  return atom;
+}
+
+// Interns the keywords. The atoms cached for an earlier unit were freed with
+// it, so the cache starts empty.
+static void keywords_init()
+{
+  if(!keyword_seed) keyword_hash_init();
+  memset(atom_cache, 0, sizeof(atom_cache));
+  for(int i = 0; i < NUM_KEYWORD; i++) {
+    struct string_view name = { .begin = (char*)keywords[i].keyword,
+                                .length = keyword_lengths[i] };
+    keyword_atoms[i] = atom_intern(name);
+    keyword_atoms[i]->type = keywords[i].token;
+  }
+}
+
+static const struct {
+  const char* name;
+  enum BuiltinMacro builtin;
+} builtins[NUM_BUILTIN - 1] = {
+  {"__LINE__", BUILTIN_LINE},
+  {"__FILE__", BUILTIN_FILE},
+  {"__COUNTER__", BUILTIN_COUNTER},
+  {"__DATE__", BUILTIN_DATE},
+  {"__TIME__", BUILTIN_TIME},
+  {"__STDC__", BUILTIN_STDC},
+  {"__STDC_HOSTED__", BUILTIN_STDC_HOSTED},
+  {"__STDC_VERSION__", BUILTIN_STDC_VERSION}
+};
+
+// The spelling last made for each builtin and the value it was made for.
+// It is reused while the value stays the same, so every __LINE__ on a line
+// and every __FILE__ in a file share one, and the values that are fixed
+// for the translation unit are only spelled once.
+struct BuiltinSpelling {
+  struct string_view value;
+  enum TType type;
+  int file_id;
+  long key;
+};
+
+static struct BuiltinSpelling builtin_spellings[NUM_BUILTIN];
+static long builtin_counter = 0;
+static time_t translation_time;
+static unsigned long builtins_expanded = 0;
+static unsigned long builtins_spelled = 0;
+
+static void builtins_init()
+{
+  for(int i = 0; i < NUM_BUILTIN - 1; i++) {
+    struct string_view name = { .begin = (char*)builtins[i].name,
+                                .length = strlen(builtins[i].name) };
+    struct Atom* atom = atom_intern(name);
+    atom->builtin = builtins[i].builtin;
+    atom->is_macro = true;
+  }
+  memset(builtin_spellings, 0, sizeof(builtin_spellings));
+  builtin_counter = 0;
+  translation_time = time(NULL);
+}
+
+// The tokens passed for one parameter of a function-like macro and, once a
+// parameter that is not an operand of # or ## has been read, what they
+// expand to.
+struct MacroArg {
+  const struct MacroToken* tokens;
+  size_t count;
+  const struct MacroToken* expanded;
+  size_t expanded_count;
+  bool is_expanded;
+};
+
+// How far reading a file has gone in showing that a single
+// #ifndef X ... #endif holds all of it, which makes including it again a
+// no-op once X is defined.
+enum GuardState {
+  GUARD_NONE,   // Not guarded
+  GUARD_OPEN,   // Inside the #ifndef
+  GUARD_START,  // Nothing but whitespace and comments read yet
+  GUARD_CLOSED  // Past its #endif, with nothing read since; from
+                // GUARD_START on, reading a token ends the guard
+};
+
+// A frame of the lexer stack reads either characters from a buffer or, for
+// a macro expansion, already lexed tokens. A macro's frame reads its body
+// in place, and when it comes to a parameter it reads the argument's tokens
+// in place before going on with the body.
 struct lexer {
-  char* current_file;
-  char* buffer;
-  size_t buffer_size;
-  size_t buffer_loc;
+  int file_id;
   int line;
   int position;
+  const struct MacroToken* tokens; // NULL when reading a buffer
+  union {
+    struct {
+      char* buffer;
+      size_t buffer_size;
+      size_t buffer_loc;
+      const size_t* splices;
+      size_t splice_count;
+      size_t next_splice;
+      enum GuardState guard_state;
+      int guard_atom; // The macro of the #ifndef that opened the file
+      size_t cond_base; // Conditionals open before the file was pushed
+      double start_time;
+    };
+    struct {
+      size_t token_count;
+      size_t next_token;
+      struct MacroArg* args;
+      size_t arg_count;
+      const struct MacroToken* arg_next; // Rest of the argument being read
+      const struct MacroToken* arg_end;
+      int hideset; // Added to the hide set of every token read
+      int union_of; // An argument token's hide set and, in union_is, the
+      int union_is; // union with hideset; the tokens of one argument
+                    // usually share their hide set
+      bool replace_space; // The next token read has whitespace before it
+      bool arg_space;     // if arg_space is set, whatever it had: it stands
+                          // for the macro name or the parameter it replaces
+      bool in_arg;        // arg_next and arg_end are an argument being read
+      bool barrier; // Reads an argument being expanded, and ends the input
+                    // where it ends instead of being popped
+    };
+  };
+  struct ArenaMark mark; // expansion_arena as it was before this was pushed
   struct lexer* next;
 };
 
-PreprocessorTable prepTable;
+// unit_arena holds what lives as long as the translation unit.
+// expansion_arena is a stack: each pushed lexer frame opens a scope, holding
+// the frame and its expansion, that is released when it is popped.
+struct Arena unit_arena;
+struct Arena expansion_arena;
+
 MacroTable macroTable;
 struct lexer* lexer = NULL;
+unsigned long directive_count = 0;
+
+// What is known about each file read for an #include, by file id: the
+// macro whose #ifndef guards all of it, or -1, whether it has #pragma once,
+// and how long the first inclusion took. Including it again is skipped
+// without touching the file if either says it would add nothing.
+struct IncludeInfo {
+  int guard;
+  bool once;
+  bool read;
+  bool prefetched; // The files it includes have been asked for
+  double seconds;
+};
+
+#define MAX_INCLUDE_DEPTH 200
+
+static Array(struct IncludeInfo) include_infos = NULL;
+static int include_depth = 0;
+static unsigned long includes_read = 0;
+static unsigned long includes_skipped = 0;
+static double include_seconds_saved = 0;
+
+// The conditionals open around what is being read. Each file lexer notes
+// where its own start, since a file may not close what another opened.
+struct Conditional {
+  bool taken;     // One of its groups has been read, so the rest are not
+  bool seen_else;
+};
+
+static Array(struct Conditional) conditionals = NULL;
+static int defined_atom = -1;
+static int has_include_atom = -1;
+static unsigned long conditions_evaluated = 0;
+static unsigned long groups_skipped = 0;
+static unsigned long bytes_skipped = 0;
+
+// Scratch space for the tokens of a macro body being defined, of the
+// arguments of invocations being collected and of arguments being
+// expanded. Collecting and expanding can nest, so each use appends and
+// truncates back to where it started once its tokens are copied out.
+static Array(struct MacroToken) scratch_tokens = NULL;
+static Array(size_t) scratch_args = NULL;
+static Array(struct MacroToken) expanded_tokens = NULL;
+static unsigned long arg_uses = 0;
+static unsigned long args_expanded = 0;
+
+// Spellings made by # and ##, which live as long as the translation unit.
+// They are written at the end of the current chunk, which is registered as
+// a source so that tokens can point into it. A paste is written there as
+// scratch and only kept if it is one not made before; pasted_spellings
+// maps each kept one to the token it lexed as.
+#define SPELLING_CHUNK (1 << 15)
+
+struct PastedToken {
+  char* begin;
+  enum TType type;
+  int atom;
+  int file_id;
+};
 
-jmp_buf jbuf;
+static char* spelling_ptr = NULL;
+static char* spelling_end = NULL;
+static int spelling_file_id = -1;
+static struct HashMap pasted_spellings;
+static unsigned long pasted_count = 0;
+static unsigned long stringified_count = 0;
+static unsigned long spelling_bytes = 0;
 
 struct string_view curr_def = {0};
 int curr_def_pos = 0;
 bool in_def = false;
 
+// Character classes for the lexer, independent of the current locale. The
+// low byte holds CC_* flags and the high byte the sub-lexer a token starting
+// with that character goes to. '\0' is the buffer sentinel and has no
+// flags, so every class test also stops at the end of the buffer.
+enum CharClass {
+  CC_SPACE  = 1 << 0,
+  CC_DIGIT  = 1 << 1,
+  CC_XDIGIT = 1 << 2,
+  CC_ALPHA  = 1 << 3,
+  CC_IDENT  = 1 << 4,
+  CC_PUNCT  = 1 << 5
+};
+
+enum CharStart {
+  START_INVALID = 0,
+  START_END,
+  START_SPACE,
+  START_IDENT,
+  START_DIGIT,
+  START_DOT,
+  START_APOSTROPHE,
+  START_QUOTE,
+  START_PUNCT
+};
+
+#define SPACE      (CC_SPACE | START_SPACE << 8)
+#define DIGIT      (CC_DIGIT | CC_XDIGIT | CC_IDENT | START_DIGIT << 8)
+#define HEXALPHA   (CC_ALPHA | CC_XDIGIT | CC_IDENT | START_IDENT << 8)
+#define ALPHA      (CC_ALPHA | CC_IDENT | START_IDENT << 8)
+#define UNDERSCORE (CC_IDENT | START_IDENT << 8)
+#define PUNCT      (CC_PUNCT | START_PUNCT << 8)
+#define QUOTE      (CC_PUNCT | START_QUOTE << 8)
+#define APOSTROPHE (CC_PUNCT | START_APOSTROPHE << 8)
+#define DOT        (CC_PUNCT | START_DOT << 8)
+
+static const unsigned short char_classes[256] = {
+  ['\0'] = START_END << 8,
+  ['\t'] = SPACE, ['\n'] = SPACE, ['\v'] = SPACE, ['\f'] = SPACE,
+  ['\r'] = SPACE, [' '] = SPACE,
+  ['0'] = DIGIT, ['1'] = DIGIT, ['2'] = DIGIT, ['3'] = DIGIT, ['4'] = DIGIT,
+  ['5'] = DIGIT, ['6'] = DIGIT, ['7'] = DIGIT, ['8'] = DIGIT, ['9'] = DIGIT,
+  ['a'] = HEXALPHA, ['b'] = HEXALPHA, ['c'] = HEXALPHA, ['d'] = HEXALPHA,
+  ['e'] = HEXALPHA, ['f'] = HEXALPHA, ['A'] = HEXALPHA, ['B'] = HEXALPHA,
+  ['C'] = HEXALPHA, ['D'] = HEXALPHA, ['E'] = HEXALPHA, ['F'] = HEXALPHA,
+  ['g'] = ALPHA, ['h'] = ALPHA, ['i'] = ALPHA, ['j'] = ALPHA, ['k'] = ALPHA,
+  ['l'] = ALPHA, ['m'] = ALPHA, ['n'] = ALPHA, ['o'] = ALPHA, ['p'] = ALPHA,
+  ['q'] = ALPHA, ['r'] = ALPHA, ['s'] = ALPHA, ['t'] = ALPHA, ['u'] = ALPHA,
+  ['v'] = ALPHA, ['w'] = ALPHA, ['x'] = ALPHA, ['y'] = ALPHA, ['z'] = ALPHA,
+  ['G'] = ALPHA, ['H'] = ALPHA, ['I'] = ALPHA, ['J'] = ALPHA, ['K'] = ALPHA,
+  ['L'] = ALPHA, ['M'] = ALPHA, ['N'] = ALPHA, ['O'] = ALPHA, ['P'] = ALPHA,
+  ['Q'] = ALPHA, ['R'] = ALPHA, ['S'] = ALPHA, ['T'] = ALPHA, ['U'] = ALPHA,
+  ['V'] = ALPHA, ['W'] = ALPHA, ['X'] = ALPHA, ['Y'] = ALPHA, ['Z'] = ALPHA,
+  ['_'] = UNDERSCORE,
+  ['!'] = PUNCT, ['$'] = PUNCT, ['%'] = PUNCT, ['&'] = PUNCT, ['('] = PUNCT,
+  [')'] = PUNCT, ['*'] = PUNCT, ['+'] = PUNCT, [','] = PUNCT, ['-'] = PUNCT,
+  ['/'] = PUNCT, [':'] = PUNCT, [';'] = PUNCT, ['<'] = PUNCT, ['='] = PUNCT,
+  ['>'] = PUNCT, ['?'] = PUNCT, ['@'] = PUNCT, ['['] = PUNCT, ['\\'] = PUNCT,
+  [']'] = PUNCT, ['^'] = PUNCT, ['`'] = PUNCT, ['{'] = PUNCT, ['|'] = PUNCT,
+  ['}'] = PUNCT, ['~'] = PUNCT,
+  ['"'] = QUOTE, ['\''] = APOSTROPHE, ['.'] = DOT, ['#'] = PUNCT
+};
+
+#undef SPACE
+#undef DIGIT
+#undef HEXALPHA
+#undef ALPHA
+#undef UNDERSCORE
+#undef PUNCT
+#undef QUOTE
+#undef APOSTROPHE
+#undef DOT
+
+static inline unsigned char_class(char c)
+{
+  return char_classes[(unsigned char)c] & 0xff;
+}
+
+static inline enum CharStart char_start(char c)
+{
+  return (enum CharStart)(char_classes[(unsigned char)c] >> 8);
+}
+
 static inline char* lexer_loc()
 {
     return &lexer->buffer[lexer->buffer_loc];
@@ -141,9 +504,10 @@ static inline char advance()
   return ret;
 }
 
+// The match helpers rely on the '\0' sentinel instead of checking isAtEnd:
+// none of them accepts '\0'.
 static inline bool match(char expected)
 {
-  if(isAtEnd()) return false;
   if(peek() != expected) return false;
   advance();
   return true;
@@ -151,9 +515,9 @@ static inline bool match(char expected)
 
 static inline bool matchOne(const char* chars)
 {
-  if(isAtEnd()) return false;
+  char c = peek();
   while(*chars) {
-    if(peek() == *chars++) {
+    if(c == *chars++) {
       advance();
       return true;
     }
@@ -161,44 +525,31 @@ static inline bool matchOne(const char* chars)
   return false;
 }
 
-static inline bool matchDigit()
+static inline bool matchClass(unsigned cc)
 {
-  if(isAtEnd()) return false;
-  if(!isdigit(peek())) return false;
+  if(!(char_class(peek()) & cc)) return false;
   advance();
   return true;
 }
 
-static inline bool matchXDigit()
+static inline bool matchDigit()
 {
-  if(isAtEnd()) return false;
-  if(!isxdigit(peek())) return false;
-  advance();
-  return true;
+  return matchClass(CC_DIGIT);
 }
 
-static inline bool matchAlpha()
+static inline bool matchXDigit()
 {
-  if(isAtEnd()) return false;
-  if(!isalpha(peek())) return false;
-  advance();
-  return true;
+  return matchClass(CC_XDIGIT);
 }
 
-static inline bool matchAlNum()
+static inline bool matchAlpha()
 {
-  if(isAtEnd()) return false;
-  if(!isalnum(peek())) return false;
-  advance();
-  return true;
+  return matchClass(CC_ALPHA);
 }
 
 static inline bool matchSpace()
 {
-  if(isAtEnd()) return false;
-  if(!isspace(peek())) return false;
-  advance();
-  return true;
+  return matchClass(CC_SPACE);
 }
 
 static inline char peekNext()
@@ -207,11 +558,53 @@ static inline char peekNext()
   return lexer->buffer[lexer->buffer_loc + 1];
 }
 
+// Counts the lines joined by backslash-newlines the lexer has moved past.
+// The column is measured from the last one if no newline follows it.
+static void count_splices()
+{
+  size_t last = SIZE_MAX;
+  while(lexer->next_splice < lexer->splice_count
+        && lexer->splices[lexer->next_splice] <= lexer->buffer_loc) {
+    last = lexer->splices[lexer->next_splice++];
+    lexer->line++;
+  }
+  if(last != SIZE_MAX
+     && !memchr(lexer->buffer + last, '\n', lexer->buffer_loc - last)) {
+    lexer->position = (int)(lexer->buffer_loc - last) + 1;
+  }
+}
+
+// Returns the length of the identifier starting at the current location and
+// moves past it. Its strview_hash is built from the same words on the way.
+static inline size_t scan_identifier(uint64_t* hash)
+{
+  size_t start = lexer->buffer_loc;
+  uint64_t h = HASH_SEED;
+  while(lexer->buffer_loc + 8 <= lexer->buffer_size) {
+    uint64_t word = swar_load(lexer_loc());
+    uint64_t ident = swar_ident(word);
+    if(ident != SWAR_HIGH) {
+      size_t n = swar_first(~ident & SWAR_HIGH);
+      if(n) h = hash_word(h, swar_prefix(word, n));
+      lexer->buffer_loc += n;
+      *hash = hash_finish(h, lexer->buffer_loc - start);
+      return lexer->buffer_loc - start;
+    }
+    h = hash_word(h, word);
+    lexer->buffer_loc += 8;
+  }
+  while(char_class(peek()) & CC_IDENT) advance();
+  size_t length = lexer->buffer_loc - start;
+  *hash = strview_hash((struct string_view){ .begin = lexer->buffer + start,
+                                             .length = length });
+  return length;
+}
+
 _Noreturn
 static void error(const char* msg, ...)
 {
   fprintf(stderr, "Lexing Error (%s - line: %i, column: %i): ", 
-          lexer->current_file, lexer->line, lexer->position);
+          source_name(lexer->file_id), lexer->line, lexer->position);
   va_list ap;
   va_start(ap, msg);
   vfprintf(stderr, msg, ap);
@@ -222,7 +615,7 @@ static void error(const char* msg, ...)
 
 static void warning(const char* msg, ...) {
   fprintf(stderr, "Lexing warning (%s - line %i, column %i): ",
-          lexer->current_file, lexer->line, lexer->position);
+          source_name(lexer->file_id), lexer->line, lexer->position);
   va_list ap;
   va_start(ap, msg);
   vfprintf(stderr, msg, ap);
@@ -230,133 +623,242 @@ static void warning(const char* msg, ...) {
   fputc('\n', stderr);
 }
 
-static struct lexer lexer_create(const char* filename) {
-  return (struct lexer) {
-    .current_file = strdup(filename),
-    .buffer = NULL,
-    .buffer_size = 0,
-    .buffer_loc = 0,
-    .line = 1,
-    .position = 1,
-    .next = NULL
-  };
-}
-
-static void lexer_init(struct lexer* new_lexer)
+// Moves past n bytes that were skipped in bulk, updating line and column
+// from the newlines they contained.
+static inline void skip_bytes(size_t n)
 {
-  FILE* file = fopen(new_lexer->current_file, "r");
-  if(!file) {
-    error("Did not find file %s.\n", new_lexer->current_file);
+  size_t last = 0;
+  size_t lines = scan_count_lines(lexer_loc(), n, &last);
+  if(lines) {
+    lexer->line += (int)lines;
+    lexer->position = (int)(n - last);
+  } else {
+    lexer->position += (int)n;
   }
+  lexer->buffer_loc += n;
+}
 
-  int err = fseek(file, 0L, SEEK_END);
-  if(err) {
-    fclose(file);
-    error("Error seeking end of file %s.\n", new_lexer->current_file);
-  }
-  long ftell_ret = ftell(file);
-  if(ftell_ret == -1L) {
-    fclose(file);
-    error("Error getting end position of file %s from ftell.\n", new_lexer->current_file);
-  }
-  size_t size = (size_t)ftell_ret;
-  rewind(file);
+// Skips a // comment up to, but not including, the newline ending it.
+static inline void skip_line_comment()
+{
+  size_t remaining = lexer->buffer_size - lexer->buffer_loc;
+  const char* newline = memchr(lexer_loc(), '\n', remaining);
+  size_t n = newline ? (size_t)(newline - lexer_loc()) : remaining;
+  lexer->buffer_loc += n;
+  lexer->position += (int)n;
+}
 
-  new_lexer->buffer = malloc((size+1)*sizeof(char));
-  if(!new_lexer->buffer) {
-    fclose(file);
-    error("Failed to allocate enough memory to read in file. Need %zu bytes.\n", size);
-  }
+static inline void skip_block_comment()
+{
+  size_t remaining = lexer->buffer_size - lexer->buffer_loc;
+  size_t end = 2 + scan_find_comment_end(lexer_loc() + 2, remaining - 2);
+  if(end >= remaining) error("Unterminated comment.");
+  skip_bytes(end + 2);
+}
 
-  size_t bytes_read = fread(new_lexer->buffer, sizeof(char), size, file);
-  int eof = feof(file);
-  int ferr = ferror(file);
-  fclose(file);
-  if(bytes_read != size) {
-    if(eof) {
-      error("Unexpected EOF %f%% of the way through (%zu of %zu bytes).\n", 100.0 * ((double)bytes_read / (double)size), bytes_read, size);
-    } else if (ferr){
-      error("Error reading in %s.\n", new_lexer->current_file);
+// Skips whitespace and comments between tokens, eight bytes at a time
+// through runs of spaces such as indentation.
+static inline void skip_whitespace()
+{
+  for(;;) {
+    while(lexer->buffer_loc + 8 <= lexer->buffer_size) {
+      uint64_t spaces = swar_eq(swar_load(lexer_loc()), ' ');
+      if(spaces == SWAR_HIGH) {
+        lexer->buffer_loc += 8;
+        lexer->position += 8;
+        continue;
+      }
+      size_t n = swar_first(~spaces & SWAR_HIGH);
+      lexer->buffer_loc += n;
+      lexer->position += (int)n;
+      break;
+    }
+    char c = peek();
+    if(c == '/') {
+      if(peekNext() == '/') {
+        skip_line_comment();
+        continue;
+      }
+      if(peekNext() == '*') {
+        skip_block_comment();
+        continue;
+      }
+      return;
+    }
+    if(!(char_class(c) & CC_SPACE)) return;
+    advance();
+    if(c == '\n') {
+      lexer->line++;
+      lexer->position = 1;
     } else {
-      error("Read in fewer bytes (%zu) than expected (%zu). No error or EOF reported.\n", bytes_read, size);
+      lexer->position++;
     }
   }
-  new_lexer->buffer[size] = '\0';
-  new_lexer->buffer_size = size;
-  new_lexer->buffer_loc = 0;
-
-  prepTable = preproc_table_create();
-  macroTable = macro_table_create();
 }
 
-
-static struct lexer lexer_push(const char* filename) {
-  struct lexer new_lexer = lexer_create(filename);
-  bool begining = !lexer;
-  if(begining) lexer = &new_lexer;
-  lexer_init(&new_lexer);
-  struct lexer* tmp = malloc(sizeof(struct lexer));
-  *tmp = new_lexer;
-  tmp->next = begining ? NULL : lexer;
-  lexer = tmp;
-  return new_lexer;
+static struct lexer lexer_create(int file_id) {
+  const struct SourceFile* source = source_get(file_id);
+  return (struct lexer) {
+    .file_id = file_id,
+    .buffer = source->buffer,
+    .buffer_size = source->size,
+    .buffer_loc = 0,
+    .splices = source->splices,
+    .splice_count = source->splice_count,
+    .next_splice = 0,
+    .guard_state = GUARD_START,
+    .guard_atom = -1,
+    .cond_base = 0,
+    .line = 1,
+    .position = 1,
+    .next = NULL
+  };
 }
 
-static struct lexer lexer_push_text(struct string_view text)
+static double now_seconds()
 {
-  struct lexer new_lexer = lexer_create(lexer->current_file);
-  new_lexer.buffer = strviewtostr(text);
-  new_lexer.buffer_size = text.length;
-  new_lexer.line = lexer->line;
-  new_lexer.position = lexer->position;
-  new_lexer.next = lexer;
-  struct lexer* tmp = malloc(sizeof(struct lexer));
-  *tmp = new_lexer;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static struct IncludeInfo* include_info(int file_id);
+
+static void lexer_push(int file_id) {
+  struct IncludeInfo* info = include_info(file_id);
+  if(!info->prefetched) {
+    info->prefetched = true;
+    include_prefetch(file_id);
+  }
+  struct ArenaMark mark = arena_mark(&expansion_arena);
+  struct lexer* tmp = arena_alloc(&expansion_arena, sizeof(struct lexer));
+  *tmp = lexer_create(file_id);
+  tmp->cond_base = array_length(conditionals);
+  tmp->start_time = now_seconds();
+  tmp->mark = mark;
+  tmp->next = lexer;
   lexer = tmp;
-  return new_lexer;
 }
 
-static inline struct lexer lexer_push_str(char* str)
+// Pushes a frame reading tokens, giving them all the location of site and
+// adding hideset to their hide sets. Whatever was allocated in
+// expansion_arena since mark was taken is released along with the frame.
+static struct lexer* lexer_push_tokens(struct ArenaMark mark,
+                                       const struct MacroToken* tokens,
+                                       size_t count, const struct Token* site,
+                                       int hideset)
 {
-  struct lexer new_lexer = lexer_create(lexer->current_file);
-  new_lexer.buffer = str;
-  new_lexer.buffer_size = strlen(str);
-  new_lexer.line = lexer->line;
-  new_lexer.position = lexer->position;
-  new_lexer.next = lexer;
-  struct lexer* tmp = malloc(sizeof(struct lexer));
-  *tmp = new_lexer;
+  struct lexer* tmp = arena_alloc(&expansion_arena, sizeof(struct lexer));
+  *tmp = (struct lexer){
+    .file_id = lexer->file_id,
+    .tokens = tokens,
+    .token_count = count,
+    .next_token = 0,
+    .hideset = hideset,
+    .union_of = 0,
+    .union_is = hideset,
+    .replace_space = true,
+    .arg_space = site->space,
+    .in_arg = false,
+    .barrier = false,
+    .line = site->line,
+    .position = site->position,
+    .mark = mark,
+    .next = lexer
+  };
   lexer = tmp;
-  return new_lexer;
+  return tmp;
 }
 
 static inline void lexer_pop()
 {
   struct lexer* next = lexer->next;
-  free(lexer);
+  arena_release(&expansion_arena, lexer->mark);
   lexer = next;
 }
 
+static struct IncludeInfo* include_info(int file_id)
+{
+  while(array_length(include_infos) <= (size_t)file_id) {
+    if(array_length(include_infos) >= array_capacity(include_infos)) {
+      array_ensure(&include_infos, 2 * array_capacity(include_infos));
+    }
+    include_infos[array_length(include_infos)++] =
+      (struct IncludeInfo){ .guard = -1 };
+  }
+  return &include_infos[file_id];
+}
+
+// Pops an included file that has been read to the end. The first time,
+// what its reading showed about a guard is kept for the next #include,
+// along with how long it took. The time spent in the files it included is
+// taken out, since including it again would skip those too.
+static void lexer_pop_file()
+{
+  double elapsed = now_seconds() - lexer->start_time;
+  struct IncludeInfo* info = include_info(lexer->file_id);
+  if(!info->read) {
+    info->read = true;
+    info->seconds = elapsed;
+    if(lexer->guard_state == GUARD_CLOSED) info->guard = lexer->guard_atom;
+  }
+  include_depth--;
+  lexer_pop();
+  lexer->start_time += elapsed;
+}
+
 void setup_lexer(const char* filename) {
-  lexer_push(filename);
+  atoms_init();
+  hidesets_init();
+  keywords_init();
+  builtins_init();
+  arena_init(&unit_arena, 1 << 16);
+  arena_init(&expansion_arena, 1 << 14);
+  macro_table_init(&macroTable);
+  array_new_capacity(&scratch_tokens, 64);
+  array_new_capacity(&scratch_args, 8);
+  array_new_capacity(&expanded_tokens, 64);
+  map_init(&pasted_spellings, sizeof(struct PastedToken));
+  array_new_capacity(&include_infos, 16);
+  array_new_capacity(&conditionals, 16);
+  defined_atom = atom_intern((struct string_view){ "defined", 7 })->id;
+  has_include_atom =
+    atom_intern((struct string_view){ "__has_include", 13 })->id;
+  include_init();
+  lexer_push(source_add_file(filename, -1, 0));
 }
 
-void lex_string(struct string_view* value)
+// Lexes the rest of a string or character literal whose opening quote has
+// already been consumed. The scan kernel jumps straight to the next quote,
+// backslash or newline, so only those bytes are looked at one at a time.
+// Newlines are only allowed in string literals; for them position is set so
+// that adding the token length afterwards gives the column after the quote.
+void lex_quoted(char quote, struct string_view* value)
 {
-  while(!match('"') && !isAtEnd()) {
-    if(peek() == '\\' && peekNext() == '"') {
-      advance();
+  for(;;) {
+    size_t n = scan_find3(lexer_loc(), lexer->buffer_size - lexer->buffer_loc,
+                          quote, '\\', '\n');
+    lexer->buffer_loc += n;
+    value->length += n;
+    if(lexer->buffer_loc >= lexer->buffer_size) {
+      error(quote == '"' ? "Unterminated string literal."
+                         : "Unterminated character literal.");
+    }
+
+    char c = advance();
+    value->length++;
+    if(c == quote) return;
+    if(c == '\\') {
+      if(lexer->buffer_loc >= lexer->buffer_size) continue;
+      c = advance();
       value->length++;
     }
-    if(peek() == '\n') {
+    if(c == '\n') {
+      if(quote == '\'') error("Newline in character literal.");
       lexer->line++;
-      lexer->position=1;
+      lexer->position = 1 - (int)value->length;
     }
-    advance();
-    value->length++;
   }
-
-  value->length++;
 }
 
 enum TType lex_number(struct string_view* value)
@@ -438,7 +940,7 @@ suffix_lexing:
     goto suffix_lexing;
   }
 
-  if(!isspace(peek()) && !ispunct(peek()) && !iscntrl(peek()))
+  if(char_class(peek()) & (CC_ALPHA | CC_DIGIT) || (unsigned char)peek() >= 0x80)
     error("Unrecognized token. Expected number.");
 
   if(u_suffix) {
@@ -519,49 +1021,6 @@ suffix_lexing:
   return UNKNOWN_TOK; // Should never reach this.
 }
 
-enum TType lex_identifier_or_keyword(struct string_view* value)
-{
-  while(matchAlNum() || match('_')) {
-    value->length++;
-  }
-
-  struct string_view defined = preproc_table_get(prepTable, *value);
-  if(defined.begin != NULL) {
-      lexer_push_text(defined);
-      longjmp(jbuf, 1);
-  }
-  struct Macro defined_macro = macro_table_get(macroTable, *value);
-  if(defined_macro.text.begin != NULL) {
-      while(matchSpace()) ;
-      if(!match('(')) error("Expected '(' after macro name");
-      Array(struct string_view) arguments = array_new();
-      array_capacity(arguments) = 0;
-      array_length(arguments) = 0;
-      array_ensure(&arguments, 4);
-      while(!match(')')) {
-          struct string_view arg = { .begin = &lexer->buffer[lexer->buffer_loc],
-              .length = 0};
-          while(!match(',') && !match(')')) {
-              advance();
-              arg.length++;
-          }
-          array_sv_append(&arguments, arg);
-          if(previous() == ')') break;
-      }
-      char* text = macro_expand(defined_macro, arguments);
-      array_free(arguments);
-      lexer_push_str(text);
-      longjmp(jbuf, 1);
-  }
-
-  for(int i = 0; i < NUM_KEYWORD; i++) {
-    if(!strviewstrcmp(*value, keywords[i].keyword)) 
-      return keywords[i].token; 
-  }
-
-  return IDENTIFIER_TOK;
-}
-
 enum TType lex_operator(struct string_view* value)
 {
   char c = advance();
@@ -610,6 +1069,7 @@ enum TType lex_operator(struct string_view* value)
   case '.': return PERIOD_TOK;
   case '?': return QMARK_TOK;
   case ':': return COLON_TOK;
+  case ',': return COMMA_TOK;
   case ';': return SEMICOLON_TOK;
   case '(': return LPAREN_TOK;
   case ')': return RPAREN_TOK;
@@ -622,144 +1082,565 @@ enum TType lex_operator(struct string_view* value)
       return c == '[' ? LSQUARE_LSQUARE_TOK : RSQUARE_RSQUARE_TOK;
     }
     return c == '[' ? LSQUARE_TOK : RSQUARE_TOK;
+  case '#':
+    if(match('#')) {
+      value->length++;
+      return HASH_HASH_TOK;
+    }
+    return HASH_TOK;
   default: return UNKNOWN_TOK;
   }
 }
 
-void lex_macro(struct string_view to_define) {
-  Array(struct string_view) arg_names = array_new();
-  array_capacity(arg_names) = 0;
-  array_length(arg_names) = 0;
-  array_sv_ensure(&arg_names, 4);
+// Lexes the token at the current location into out, without skipping
+// whitespace first or expanding macros. Returns the atom of an identifier
+// or keyword and NULL for other tokens.
+static inline struct Atom* lex_one(struct Token* out)
+{
+  struct Atom* atom = NULL;
+  out->line = lexer->line;
+  out->position = lexer->position;
+  out->atom = -1;
+  out->hideset = 0;
+  struct string_view token_value = { .begin = lexer_loc(), .length = 1 };
 
-  while(!match(')')) {
-    while(matchSpace()) {
-      if(previous() == '\n') {
-        error("Expected expression to expand macro into");
-      }
-    }
-    struct string_view arg = { .begin = lexer_loc(),
-                               .length = 0 };
-    while(!match(',') && !matchSpace() && !match(')')) {
-      arg.length++;
-      advance();
-    }
-    if(previous() == ')') {
-      array_sv_append(&arg_names, arg);
+  switch(char_start(peek())) {
+  case START_END:
+    out->type = EOF_TOK;
+    break;
+  case START_APOSTROPHE:
+    advance();
+    lex_quoted('\'', &token_value);
+    if(token_value.length == 2) error("Empty character literal.");
+    out->type = CHAR_LITERAL_TOK;
+    break;
+  case START_QUOTE:
+    advance();
+    lex_quoted('"', &token_value);
+    out->type = STR_LITERAL_TOK;
+    break;
+  case START_DOT:
+    if(!(char_class(peekNext()) & CC_DIGIT)) {
+      out->type = lex_operator(&token_value);
       break;
     }
-    if(previous() == '\n') {
-      error("Expected ')' in macro");
-    }
-    if(isspace(previous())) {
-      while(!match(',') && !match(')')) advance();
-      if(previous() == ')') {
-        array_sv_append(&arg_names, arg);
-        break;
-      }
-    }
-    array_sv_append(&arg_names, arg);
+    [[fallthrough]];
+  case START_DIGIT:
+    out->type = lex_number(&token_value);
+    break;
+  case START_IDENT: {
+    uint64_t hash;
+    token_value.length = scan_identifier(&hash);
+    atom = identifier_atom(token_value, hash);
+    out->type = atom->type;
+    out->atom = atom->id;
+    break;
   }
-
-  while(matchSpace()) {
-    if(previous() == '\n') {
-      error("Expected expression to expand macro into");
-    }
+  case START_PUNCT:
+    out->type = lex_operator(&token_value);
+    break;
+  default:
+    error("Line %i, Location %i: Unreconized token.", lexer->line, lexer->position);
   }
 
-  struct string_view macro_exp = { .begin = lexer_loc(),
-                                   .length = 0 };
+  lexer->position += (int)token_value.length;
+  out->file_id = lexer->file_id;
+  out->value = token_value;
+  return atom;
+}
 
-  while(!match('\n')) {
-    macro_exp.length++;
+// Skips whitespace and comments up to the end of a directive line, leaving
+// the newline. Block comments may run over several lines.
+static inline void skip_directive_space()
+{
+  for(;;) {
+    char c = peek();
+    if(c == '/' && peekNext() == '/') {
+      skip_line_comment();
+      return;
+    }
+    if(c == '/' && peekNext() == '*') {
+      skip_block_comment();
+      continue;
+    }
+    if(c == '\n' || !(char_class(c) & CC_SPACE)) return;
     advance();
+    lexer->position++;
   }
-  struct Macro macro = { .text = macro_exp, .arg_names = arg_names };
-  macro_table_set(&macroTable, to_define, macro);
-  array_free(arg_names);
 }
 
-void preprocessor_lexer()
+// Skips the rest of a directive line and the newline ending it.
+static void skip_directive_line()
 {
-  while(matchSpace()) {
-    if(previous() == '\n') {
-      ++lexer->line;
-      lexer->position = 1;
-      return;
-    }
+  for(;;) {
+    skip_directive_space();
+    if(peek() == '\n' || isAtEnd()) break;
+    advance();
   }
+  if(lexer->next_splice < lexer->splice_count) count_splices();
+  match('\n');
+  lexer->line++;
+  lexer->position = 1;
+}
 
-  struct string_view directive = (struct string_view){ .begin = lexer_loc(),
-                                                       .length = 0};
-  while(matchAlpha()) directive.length++;
+// Whether only spaces come before i on its line, or before that only a
+// comment that ended at blank_until and itself started a line.
+static inline bool at_line_start(const char* buffer, size_t i,
+                                 size_t blank_until)
+{
+  while(i && (buffer[i - 1] == ' ' || buffer[i - 1] == '\t')) i--;
+  return !i || buffer[i - 1] == '\n' || i == blank_until;
+}
 
-  if(!strviewstrcmp(directive, "define")) {
-    while(matchSpace()) {
-      if(previous() == '\n') {
-        ++lexer->line;
-        lexer->position = 1;
-        error("Preprocessor error: define with no term to define");
-        return;
-      }
+// Whether the "//" or "/*" at i is inside a string or character literal that
+// started earlier on its line.
+static bool in_literal(const char* buffer, size_t i)
+{
+  size_t line = i;
+  while(line && buffer[line - 1] != '\n') line--;
+  char quote = '\0';
+  for(size_t j = line; j < i; j++) {
+    if(quote && buffer[j] == '\\') j++;
+    else if(buffer[j] == quote) quote = '\0';
+    else if(!quote && (buffer[j] == '"' || buffer[j] == '\'')) {
+      quote = buffer[j];
     }
-    struct string_view to_define = (struct string_view){ .begin = lexer_loc(),
-                                                         .length = 0};
-    while(!matchSpace()) {
-      if(match('(')) {
-        lex_macro(to_define);
-        return;
+  }
+  return quote != '\0';
+}
+
+// Moves past a group whose condition is false, up to the '#' of the #elif,
+// #else or #endif that ends it, without lexing anything in between. Only
+// the nesting of conditionals is followed, and comments, since a '#' in one
+// starts no directive and one before a '#' does not stop it starting one.
+// The scan kernel jumps from one '#' or '/' to the next and the lines passed
+// are counted at the end in one go.
+static void skip_inactive_group()
+{
+  const char* buffer = lexer->buffer;
+  size_t size = lexer->buffer_size;
+  size_t start = lexer->buffer_loc;
+  size_t i = start;
+  size_t blank_until = SIZE_MAX;
+  int depth = 0;
+  while((i += scan_find3(buffer + i, size - i, '#', '/', '#')) < size) {
+    if(buffer[i] == '/') {
+      if((buffer[i + 1] != '/' && buffer[i + 1] != '*')
+         || in_literal(buffer, i)) {
+        i++;
+      } else if(buffer[i + 1] == '/') {
+        const char* end = memchr(buffer + i, '\n', size - i);
+        i = end ? (size_t)(end - buffer) : size;
+      } else {
+        bool blank = at_line_start(buffer, i, blank_until);
+        i += 2;
+        i += scan_find_comment_end(buffer + i, size - i);
+        if(i < size) i += 2;
+        if(blank) blank_until = i;
       }
-      advance();
-      to_define.length++;
+      continue;
     }
-    struct string_view value = {0};
-    if(previous() != '\n') {
-      while(matchSpace()) {
-        if(previous() =='\n') {
-          goto set_define;
-        }
-      }
-      value.begin = lexer_loc();
-      while(!match('\n')) {
-        advance();
-        value.length++;
-      }
+    if(!at_line_start(buffer, i, blank_until)) {
+      i++;
+      continue;
     }
-set_define:
-    preproc_table_set(&prepTable, to_define, value);
-    lexer->line++;
-    lexer->position = 1;
-  } else if(!strviewstrcmp(directive, "undef")) { 
-    while(matchSpace()) {
-      if(previous() == '\n') {
-        ++lexer->line;
-        lexer->position = 1;
-        error("Preprocessor error: undef with no term to undef");
-        return;
-      }
+    size_t name = i + 1;
+    while(buffer[name] == ' ' || buffer[name] == '\t') name++;
+    size_t length = 0;
+    while(char_class(buffer[name + length]) & CC_IDENT) length++;
+    struct string_view directive = { (char*)buffer + name, length };
+    if(length >= 2 && directive.begin[0] == 'i' && directive.begin[1] == 'f'
+       && (length == 2 || !strviewstrcmp(directive, "ifdef")
+           || !strviewstrcmp(directive, "ifndef"))) {
+      depth++;
+    } else if(!strviewstrcmp(directive, "endif")) {
+      if(!depth--) break;
+    } else if(!depth && (!strviewstrcmp(directive, "else")
+                         || !strviewstrcmp(directive, "elif")
+                         || !strviewstrcmp(directive, "elifdef")
+                         || !strviewstrcmp(directive, "elifndef"))) {
+      break;
     }
-    struct string_view to_undef = (struct string_view){ .begin = lexer_loc(),
-                                                        .length = 0};
+    i = name + length;
+  }
+  if(i > size) i = size;
+
+  size_t last;
+  size_t lines = scan_count_lines(buffer + start, i - start, &last);
+  lexer->line += (int)lines;
+  lexer->position = lines ? (int)(i - start - last)
+                          : lexer->position + (int)(i - start);
+  lexer->buffer_loc = i;
+  if(lexer->next_splice < lexer->splice_count) count_splices();
+  groups_skipped++;
+  bytes_skipped += i - start;
+}
+
+// Opens a conditional whose first group is read if value is set and
+// skipped if not.
+static void push_conditional(bool value)
+{
+  if(array_length(conditionals) >= array_capacity(conditionals)) {
+    array_ensure(&conditionals, 2 * array_capacity(conditionals));
+  }
+  conditionals[array_length(conditionals)++] =
+    (struct Conditional){ .taken = value, .seen_else = false };
+  if(!value) skip_inactive_group();
+}
+
+// The innermost conditional the file being read opened, or an error naming
+// the directive that needs one.
+static struct Conditional* current_conditional(struct string_view directive)
+{
+  if(array_length(conditionals) == lexer->cond_base) {
+    error("#%.*s without #if.", (int)directive.length, directive.begin);
+  }
+  return &conditionals[array_length(conditionals) - 1];
+}
+
+// Lexes the macro name an #ifdef and its kin test.
+static struct Atom* directive_macro_name(struct string_view directive)
+{
+  skip_directive_space();
+  if(char_start(peek()) != START_IDENT) {
+    error("Expected a macro name after #%.*s.", (int)directive.length,
+          directive.begin);
+  }
+  struct Token name;
+  return lex_one(&name);
+}
+
+static bool eval_if_line();
+
+// Starts reading the file of an #include, unless it is known to add
+// nothing when included again: it has #pragma once, or the macro of the
+// #ifndef guarding all of it is defined.
+static void include_file(int file_id)
+{
+  struct IncludeInfo* info = include_info(file_id);
+  if(info->once || (info->guard >= 0 && atom_get(info->guard)->is_macro)) {
+    includes_skipped++;
+    include_seconds_saved += info->seconds;
+    return;
+  }
+  if(include_depth >= MAX_INCLUDE_DEPTH) {
+    error("#include nested more than %d deep.", MAX_INCLUDE_DEPTH);
+  }
+  include_depth++;
+  includes_read++;
+  lexer_push(file_id);
+}
+
+static void append_token(Array(struct MacroToken)* tokens,
+                         const struct Token* tok)
+{
+  if(array_length(*tokens) >= array_capacity(*tokens)) {
+    array_ensure(tokens, 2 * array_capacity(*tokens));
+  }
+  (*tokens)[array_length(*tokens)++] = (struct MacroToken){
+    .value = tok->value,
+    .type = tok->type,
+    .atom = tok->atom,
+    .file_id = tok->file_id,
+    .param = -1,
+    .hideset = tok->hideset,
+    .space = tok->space
+  };
+}
+
+// Lexes a macro body up to the end of the directive line, leaving the
+// newline. Returns the tokens in an array of their own. The directive may
+// be among the arguments of an invocation, so the scratch tokens collected
+// for them are left alone.
+static Array(struct MacroToken) lex_macro_body()
+{
+  size_t base = array_length(scratch_tokens);
+  for(;;) {
+    size_t start = lexer->buffer_loc;
+    skip_directive_space();
+    if(peek() == '\n' || isAtEnd()) break;
+    if(lexer->next_splice < lexer->splice_count) count_splices();
+    bool space = lexer->buffer_loc != start;
+    struct Token tok;
+    lex_one(&tok);
+    tok.space = space;
+    append_token(&scratch_tokens, &tok);
+  }
+
+  Array(struct MacroToken) body;
+  size_t count = array_length(scratch_tokens) - base;
+  array_new_capacity(&body, count);
+  memcpy(body, scratch_tokens + base, count * sizeof(*body));
+  array_length(body) = count;
+  array_length(scratch_tokens) = base;
+  return body;
+}
+
+// ## needs a token on both sides and, in a function-like macro, # needs a
+// parameter or __VA_OPT__ after it. __VA_OPT__ needs a balanced group in
+// parentheses, which may not hold another __VA_OPT__ or start or end with
+// ##.
+static void check_operators(const struct Macro* macro)
+{
+  if(!macro->has_operators) return;
+  size_t count = array_length(macro->body);
+  if(macro->body[0].type == HASH_HASH_TOK
+     || macro->body[count - 1].type == HASH_HASH_TOK) {
+    error("'##' cannot appear at either end of a macro expansion.");
+  }
+  if(!macro->function_like) return;
+  for(size_t i = 0; i < count; i++) {
+    if(macro->body[i].type == HASH_TOK
+       && (i + 1 == count || (macro->body[i + 1].param < 0
+                              && macro->body[i + 1].param != VA_OPT_PARAM))) {
+      error("'#' is not followed by a macro parameter.");
+    }
+    if(macro->body[i].param != VA_OPT_PARAM) continue;
+    if(i + 1 == count || macro->body[i + 1].type != LPAREN_TOK) {
+      error("__VA_OPT__ must be followed by '('.");
+    }
+    int depth = 0;
+    size_t first = i + 2;
+    for(i = first;; i++) {
+      if(i == count) error("Unterminated __VA_OPT__.");
+      if(macro->body[i].param == VA_OPT_PARAM) {
+        error("__VA_OPT__ may not appear inside __VA_OPT__.");
+      }
+      if(macro->body[i].type == LPAREN_TOK) depth++;
+      else if(macro->body[i].type == RPAREN_TOK && !depth--) break;
+    }
+    if(i > first && (macro->body[first].type == HASH_HASH_TOK
+                     || macro->body[i - 1].type == HASH_HASH_TOK)) {
+      error("'##' cannot appear at either end of __VA_OPT__.");
+    }
+  }
+}
+
+// Adds a parameter to a macro being defined. A parameter spelled ... is
+// named __VA_ARGS__ and, as in GCC, name... is a variadic parameter with a
+// name of its own.
+static void add_param(Array(int)* params, struct string_view name,
+                      bool* variadic)
+{
+  if(*variadic) error("Variadic parameter must be the last.");
+  if(name.length >= 3 && !memcmp(name.begin + name.length - 3, "...", 3)) {
+    *variadic = true;
+    name.length -= 3;
+    if(!name.length) name = (struct string_view){ .begin = "__VA_ARGS__",
+                                                  .length = 11 };
+  }
+  if(!name.length) {
+    if(!array_length(*params) && !*variadic) return;
+    error("Expected parameter name in macro.");
+  }
+  if(array_length(*params) >= array_capacity(*params)) {
+    array_ensure(params, 2 * array_capacity(*params));
+  }
+  (*params)[array_length(*params)++] = atom_intern(name)->id;
+}
+
+void lex_macro(struct string_view to_define) {
+  Array(int) params;
+  array_new_capacity(&params, 4);
+  bool variadic = false;
+
+  while(!match(')')) {
+    while(matchSpace()) {
+      if(previous() == '\n') {
+        error("Expected expression to expand macro into");
+      }
+    }
+    struct string_view arg = { .begin = lexer_loc(),
+                               .length = 0 };
+    while(!match(',') && !matchSpace() && !match(')')) {
+      arg.length++;
+      advance();
+    }
+    if(previous() == ')') {
+      add_param(&params, arg, &variadic);
+      break;
+    }
+    if(previous() == '\n') {
+      error("Expected ')' in macro");
+    }
+    if(char_class(previous()) & CC_SPACE) {
+      while(!match(',') && !match(')')) advance();
+      if(previous() == ')') {
+        add_param(&params, arg, &variadic);
+        break;
+      }
+    }
+    add_param(&params, arg, &variadic);
+  }
+
+  Array(struct MacroToken) body = lex_macro_body();
+  struct Macro macro = { .body = body, .params = params,
+                         .file_id = lexer->file_id, .function_like = true,
+                         .variadic = variadic };
+  macro_resolve_params(&macro);
+  check_operators(&macro);
+  match('\n');
+  lexer->line++;
+  lexer->position = 1;
+  struct Atom* atom = atom_intern(to_define);
+  macro_table_set(&macroTable, atom->name, atom->hash, macro);
+  atom->builtin = BUILTIN_NONE;
+  atom->is_macro = true;
+  atom->is_function_like = true;
+}
+
+void preprocessor_lexer()
+{
+  directive_count++;
+  // Only a directive of the #ifndef around the whole file keeps it guarded
+  enum GuardState guard = lexer->guard_state;
+  if(guard != GUARD_OPEN) lexer->guard_state = GUARD_NONE;
+  while(matchSpace()) {
+    if(previous() == '\n') {
+      ++lexer->line;
+      lexer->position = 1;
+      return;
+    }
+  }
+
+  struct string_view directive = (struct string_view){ .begin = lexer_loc(),
+                                                       .length = 0};
+  while(matchClass(CC_IDENT)) directive.length++;
+
+  if(!strviewstrcmp(directive, "define")) {
+    while(matchSpace()) {
+      if(previous() == '\n') {
+        ++lexer->line;
+        lexer->position = 1;
+        error("Preprocessor error: define with no term to define");
+        return;
+      }
+    }
+    struct string_view to_define = (struct string_view){ .begin = lexer_loc(),
+                                                         .length = 0};
+    while(!matchSpace()) {
+      if(match('(')) {
+        lex_macro(to_define);
+        return;
+      }
+      advance();
+      to_define.length++;
+    }
+    Array(struct MacroToken) body;
+    if(previous() == '\n') {
+      array_new_capacity(&body, 0);
+    } else {
+      body = lex_macro_body();
+      match('\n');
+    }
+    struct Macro macro = { .body = body, .file_id = lexer->file_id };
+    macro_resolve_params(&macro);
+    check_operators(&macro);
+    struct Atom* atom = atom_intern(to_define);
+    macro_table_set(&macroTable, atom->name, atom->hash, macro);
+    atom->builtin = BUILTIN_NONE;
+    atom->is_macro = true;
+    atom->is_function_like = false;
+    lexer->line++;
+    lexer->position = 1;
+  } else if(!strviewstrcmp(directive, "undef")) { 
+    while(matchSpace()) {
+      if(previous() == '\n') {
+        ++lexer->line;
+        lexer->position = 1;
+        error("Preprocessor error: undef with no term to undef");
+        return;
+      }
+    }
+    struct string_view to_undef = (struct string_view){ .begin = lexer_loc(),
+                                                        .length = 0};
     while(!matchSpace()) {
       advance();
       to_undef.length++;
     }
     bool found_end = false;
     if(previous() == '\n') found_end = true;
-    preproc_table_delete(&prepTable, to_undef);
+    struct Atom* atom = atom_intern(to_undef);
+    macro_table_delete(&macroTable, atom->name, atom->hash);
+    atom->builtin = BUILTIN_NONE;
+    atom->is_macro = false;
     if(!found_end)
       while(!match('\n')) advance();
     lexer->line++;
     lexer->position = 1;
-  } else if(!strviewstrcmp(directive, "include")) { 
-  } else if(!strviewstrcmp(directive, "if")) { 
-  } else if(!strviewstrcmp(directive, "ifdef")) { 
-  } else if(!strviewstrcmp(directive, "ifndef")) { 
-  } else if(!strviewstrcmp(directive, "else")) { 
-  } else if(!strviewstrcmp(directive, "elif")) { 
-  } else if(!strviewstrcmp(directive, "elifdef")) { 
-  } else if(!strviewstrcmp(directive, "elifndef")) { 
-  } else if(!strviewstrcmp(directive, "endif")) { 
+  } else if(!strviewstrcmp(directive, "include")
+            || !strviewstrcmp(directive, "include_next")) {
+    skip_directive_space();
+    char close = match('"') ? '"' : match('<') ? '>' : '\0';
+    if(!close) {
+      error("Expected \"file\" or <file> after #%.*s.",
+            (int)directive.length, directive.begin);
+    }
+    struct string_view name = (struct string_view){ .begin = lexer_loc(),
+                                                    .length = 0};
+    while(peek() != close && peek() != '\n' && !isAtEnd()) {
+      advance();
+      name.length++;
+    }
+    if(!match(close) || !name.length) {
+      error("Expected %c after the file name of #%.*s.", close,
+            (int)directive.length, directive.begin);
+    }
+    int file_id = include_resolve(name, close == '"', directive.length > 7,
+                                  lexer->file_id, lexer->line);
+    if(file_id < 0) {
+      error("Did not find %.*s to include.", (int)name.length, name.begin);
+    }
+    skip_directive_line();
+    include_file(file_id);
+  } else if(!strviewstrcmp(directive, "if")) {
+    push_conditional(eval_if_line());
+  } else if(!strviewstrcmp(directive, "ifdef")
+            || !strviewstrcmp(directive, "ifndef")) {
+    struct Atom* name = directive_macro_name(directive);
+    bool is_ifndef = directive.length == 6;
+    if(guard == GUARD_START && is_ifndef) {
+      lexer->guard_state = GUARD_OPEN;
+      lexer->guard_atom = name->id;
+    }
+    skip_directive_line();
+    push_conditional(name->is_macro != is_ifndef);
+  } else if(!strviewstrcmp(directive, "else")
+            || !strviewstrcmp(directive, "elif")
+            || !strviewstrcmp(directive, "elifdef")
+            || !strviewstrcmp(directive, "elifndef")) {
+    struct Conditional* top = current_conditional(directive);
+    if(top->seen_else) {
+      error("#%.*s after #else.", (int)directive.length, directive.begin);
+    }
+    if(guard == GUARD_OPEN
+       && array_length(conditionals) == lexer->cond_base + 1) {
+      lexer->guard_state = GUARD_NONE;
+    }
+    bool take = false;
+    if(!strviewstrcmp(directive, "else")) {
+      top->seen_else = true;
+      take = !top->taken;
+      skip_directive_line();
+    } else if(top->taken) {
+      skip_directive_line();
+    } else if(!strviewstrcmp(directive, "elif")) {
+      take = eval_if_line();
+    } else {
+      struct Atom* name = directive_macro_name(directive);
+      skip_directive_line();
+      take = name->is_macro == (directive.length == 7); // #elifdef
+    }
+    if(take) top->taken = true;
+    else skip_inactive_group();
+  } else if(!strviewstrcmp(directive, "endif")) {
+    current_conditional(directive);
+    if(guard == GUARD_OPEN
+       && array_length(conditionals) == lexer->cond_base + 1) {
+      lexer->guard_state = GUARD_CLOSED;
+    }
+    array_length(conditionals)--;
+    skip_directive_line();
   } else if(!strviewstrcmp(directive, "line")) { 
   } else if(!strviewstrcmp(directive, "embed")) { 
   } else if(!strviewstrcmp(directive, "error")) { 
@@ -811,6 +1692,12 @@ set_define:
         return;
       }
     }
+    if(!strncmp(lexer_loc(), "once", 4)
+       && !(char_class(lexer_loc()[4]) & CC_IDENT)) {
+      include_info(lexer->file_id)->once = true;
+      skip_directive_line();
+      return;
+    }
     struct string_view to_warn = (struct string_view){ .begin = lexer_loc(),
                                                        .length = 0};
     while(!match('\n')) {
@@ -826,94 +1713,1273 @@ set_define:
   }
 }
 
-bool get_next_token(struct Token* out)
+static void expand_argument(struct MacroArg* arg);
+
+// Returns the next token of the token frames on top of the stack without
+// consuming it, or NULL once they are all finished and the top is a buffer
+// again or a barrier with no tokens left. Finished frames are popped on the
+// way, so the token returned is in the frame left on top. A parameter reads
+// its argument fully macro-expanded.
+//
+// The whitespace before the first token of an expansion is that before the
+// macro name, and the first token of an argument takes that before the
+// parameter unless it is the first of the expansion. As in gcc, a space
+// that came to nothing, because the argument or the expansion was empty,
+// carries on to the token after it.
+static const struct MacroToken* peek_frame_token()
 {
-  if(!out) return 0;
+  while(lexer->tokens) {
+    if(lexer->arg_next != lexer->arg_end) return lexer->arg_next;
+    if(lexer->in_arg) {
+      lexer->in_arg = false;
+      if(!lexer->arg_space) lexer->replace_space = false;
+    }
+    if(lexer->next_token == lexer->token_count) {
+      if(lexer->barrier) return NULL;
+      bool space = lexer->replace_space && lexer->arg_space;
+      lexer_pop();
+      if(space && lexer->tokens) {
+        lexer->replace_space = true;
+        lexer->arg_space = true;
+      }
+      continue;
+    }
+    const struct MacroToken* tok = &lexer->tokens[lexer->next_token];
+    if(tok->param < 0) return tok;
+    lexer->next_token++;
+    if(!lexer->replace_space) {
+      lexer->replace_space = true;
+      lexer->arg_space = tok->space;
+    }
+    lexer->in_arg = true;
+    struct MacroArg* arg = &lexer->args[tok->param];
+    arg_uses++;
+    if(!arg->is_expanded) expand_argument(arg);
+    lexer->arg_next = arg->expanded;
+    lexer->arg_end = arg->expanded + arg->expanded_count;
+  }
+  return NULL;
+}
+
+// Pops the token frames on top of the stack that have no tokens left, so
+// that an expansion in the last token of another replaces its frame rather
+// than going on top of it. Long chains of such expansions then run in a
+// stack of constant depth.
+static inline void pop_finished_frames()
+{
+  while(lexer->tokens && !lexer->barrier && lexer->arg_next == lexer->arg_end
+        && lexer->next_token == lexer->token_count) {
+    lexer_pop();
+  }
+}
 
-  setjmp(jbuf);
+// Consumes the token peek_frame_token returned.
+static inline void skip_frame_token()
+{
+  if(lexer->arg_next != lexer->arg_end) lexer->arg_next++;
+  else lexer->next_token++;
+}
 
-  out->type = UNKNOWN_TOK;
+// Lexes the next token from the top of the lexer stack into out, without
+// expanding it. Directives are handled and finished frames popped on the
+// way. Returns the atom of an identifier or keyword and NULL otherwise. At
+// the end of a barrier frame the token is EOF_TOK.
+static struct Atom* lex_unexpanded(struct Token* out)
+{
+  bool space = false;
+  for(;;) {
+    if(lexer->tokens) {
+      const struct MacroToken* tok = peek_frame_token();
+      if(!tok && lexer->tokens) {
+        *out = (struct Token){ .file_id = lexer->file_id, .line = lexer->line,
+                               .position = lexer->position, .type = EOF_TOK,
+                               .atom = -1 };
+        return NULL;
+      }
+      if(!tok) continue;
+      out->space = lexer->replace_space ? lexer->arg_space : tok->space;
+      lexer->replace_space = false;
+      skip_frame_token();
+      out->file_id = tok->file_id;
+      out->line = lexer->line;
+      out->position = lexer->position;
+      out->type = tok->type;
+      out->value = tok->value;
+      out->atom = tok->atom;
+      out->hideset = lexer->hideset;
+      if(tok->hideset) {
+        if(tok->hideset != lexer->union_of) {
+          lexer->union_of = tok->hideset;
+          lexer->union_is = hideset_union(tok->hideset, lexer->hideset);
+        }
+        out->hideset = lexer->union_is;
+      }
+      return tok->atom >= 0 ? atom_get(tok->atom) : NULL;
+    }
 
-skip_whitespace:
+    size_t start = lexer->buffer_loc;
+    skip_whitespace();
 
-  while(matchSpace()) {
+    if(match('#')) {
+      preprocessor_lexer();
+      space = true;
+      continue;
+    }
+
+    if(lexer->next_splice < lexer->splice_count) count_splices();
+
+    space = space || lexer->buffer_loc != start;
+    struct Atom* atom = lex_one(out);
+    out->space = space;
+    if(out->type == EOF_TOK) {
+      if(array_length(conditionals) > lexer->cond_base) {
+        error("#if without #endif at the end of the file.");
+      }
+      if(lexer->next) {
+        lexer_pop_file();
+        continue;
+      }
+    }
+    if(lexer->guard_state >= GUARD_START) lexer->guard_state = GUARD_NONE;
+    return atom;
+  }
+}
+
+// Looks past whitespace for the '(' that makes the name of a function-like
+// macro an invocation, and consumes it if it is there. Finished expansions
+// are popped on the way since the parenthesis may follow one.
+static bool match_lparen()
+{
+  for(;;) {
+    if(lexer->tokens) {
+      const struct MacroToken* tok = peek_frame_token();
+      if(!tok && lexer->tokens) return false;
+      if(!tok) continue;
+      if(tok->type != LPAREN_TOK) return false;
+      skip_frame_token();
+      lexer->replace_space = false;
+      return true;
+    }
+    skip_whitespace();
+    if(!match('(')) return false;
     lexer->position++;
-    if(previous() == '\n') {
-      lexer->line++;
-      lexer->position = 1;
+    return true;
+  }
+}
+
+static void start_scratch_arg()
+{
+  if(array_length(scratch_args) >= array_capacity(scratch_args)) {
+    array_ensure(&scratch_args, 2 * array_capacity(scratch_args));
+  }
+  scratch_args[array_length(scratch_args)++] = array_length(scratch_tokens);
+}
+
+// Collects the arguments of an invocation of macro up to the closing ')',
+// appending their tokens to scratch_tokens and where each one starts to
+// scratch_args. Commas only separate arguments outside of parentheses, and
+// the variadic parameter takes the rest of them. The arguments of another
+// invocation may be collected while reading these, when a parameter is
+// expanded, so each collection only appends. A directive among the
+// arguments can resize the macro table, so the macro is described by what
+// is needed of it rather than by a pointer into the table. Returns the hide
+// set of the ')'.
+static int collect_arguments(size_t params, bool variadic, size_t first_arg)
+{
+  int depth = 0;
+  struct Token tok;
+  lex_unexpanded(&tok);
+  if(tok.type == RPAREN_TOK) return tok.hideset;
+
+  start_scratch_arg();
+  for(;; lex_unexpanded(&tok)) {
+    switch(tok.type) {
+    case EOF_TOK:
+      error("Unterminated argument list of macro.");
+    case LPAREN_TOK:
+      depth++;
+      break;
+    case RPAREN_TOK:
+      if(!depth) return tok.hideset;
+      depth--;
+      break;
+    case COMMA_TOK:
+      if(depth || (variadic
+                   && array_length(scratch_args) - first_arg == params)) {
+        break;
+      }
+      start_scratch_arg();
+      continue;
+    default:
+      break;
     }
+    append_token(&scratch_tokens, &tok);
   }
+}
 
-  if(match('#')) {
-    preprocessor_lexer();
-    goto skip_whitespace;
+// Returns room for size bytes and a '\0' after them at the end of the
+// spelling buffer. What is kept of it is claimed by moving spelling_ptr.
+static char* spelling_reserve(size_t size)
+{
+  if((size_t)(spelling_end - spelling_ptr) <= size) {
+    size_t chunk = size < SPELLING_CHUNK ? SPELLING_CHUNK : size + 1;
+    spelling_ptr = arena_alloc(&unit_arena, chunk);
+    spelling_end = spelling_ptr + chunk;
+    spelling_file_id = source_add_expansion(lexer->file_id, lexer->line,
+                                            spelling_ptr, chunk);
   }
- 
-  out->line = lexer->line;
-  out->position = lexer->position;
-  struct string_view token_value = (struct string_view){.begin = lexer_loc(), .length = 1};
-  
-  char next = ' ';
+  return spelling_ptr;
+}
 
-  if(isAtEnd()) {
-    if(lexer->next) {
-      lexer_pop();
-      longjmp(jbuf, 2);
+// Pastes two tokens into one. Their spellings are written next to each
+// other and, unless the same paste was made before, only that text is
+// lexed, which must make exactly one token.
+static struct MacroToken paste_tokens(const struct MacroToken* left,
+                                      const struct MacroToken* right)
+{
+  struct string_view spelling = {
+    .begin = spelling_reserve(left->value.length + right->value.length),
+    .length = left->value.length + right->value.length
+  };
+  memcpy(spelling.begin, left->value.begin, left->value.length);
+  memcpy(spelling.begin + left->value.length, right->value.begin,
+         right->value.length);
+  spelling.begin[spelling.length] = '\0';
+  pasted_count++;
+
+  uint64_t hash = strview_hash(spelling);
+  bool is_new;
+  struct PastedToken* pasted = map_insert(&pasted_spellings, spelling, hash,
+                                          &is_new);
+  if(is_new) {
+    struct lexer paste = { .file_id = spelling_file_id,
+                           .buffer = spelling.begin,
+                           .buffer_size = spelling.length,
+                           .line = lexer->line, .position = lexer->position };
+    struct lexer* outer = lexer;
+    lexer = &paste;
+    struct Token tok;
+    lex_one(&tok);
+    lexer = outer;
+    if(paste.buffer_loc != spelling.length) {
+      error("Pasting \"%.*s\" and \"%.*s\" does not give a valid token.",
+            (int)left->value.length, left->value.begin,
+            (int)right->value.length, right->value.begin);
     }
-    out->type = EOF_TOK;
-  } else if(match('\'')) { // lex char inlexer->line
-    if(match('\\')) {
-      token_value.length++;
-      if(matchOne("\'\"\?\\abfnrtv")) {
-        if(!match('\'')) {
-          error("Expected \' after escape-sequence-char. File %s, line %i, position %i.\n", lexer->current_file, lexer->line, lexer->position);
+    *pasted = (struct PastedToken){ .begin = spelling.begin, .type = tok.type,
+                                    .atom = tok.atom,
+                                    .file_id = spelling_file_id };
+    spelling_ptr += spelling.length;
+    spelling_bytes += spelling.length;
+  }
+  return (struct MacroToken){
+    .value = { .begin = pasted->begin, .length = spelling.length },
+    .type = pasted->type,
+    .atom = pasted->atom,
+    .file_id = pasted->file_id,
+    .param = -1,
+    .hideset = hideset_intersect(left->hideset, right->hideset),
+    .space = left->space
+  };
+}
+
+// Makes a string literal of the spelling of an argument, written straight
+// into the spelling buffer. Whitespace between its tokens becomes a single
+// space, and '"' and '\' in string and character literals are escaped.
+static struct MacroToken stringify(struct MacroArg arg)
+{
+  size_t size = 2;
+  for(size_t i = 0; i < arg.count; i++) size += 2 * arg.tokens[i].value.length + 1;
+  char* text = spelling_reserve(size);
+
+  char* out = text;
+  *out++ = '"';
+  for(size_t i = 0; i < arg.count; i++) {
+    const struct MacroToken* tok = &arg.tokens[i];
+    if(i && tok->space) *out++ = ' ';
+    if(tok->type < CHAR_LITERAL_TOK || tok->type > WIDE_STR_LITERAL_TOK) {
+      memcpy(out, tok->value.begin, tok->value.length);
+      out += tok->value.length;
+      continue;
+    }
+    for(size_t j = 0; j < tok->value.length; j++) {
+      char c = tok->value.begin[j];
+      if(c == '"' || c == '\\') *out++ = '\\';
+      *out++ = c;
+    }
+  }
+  *out++ = '"';
+
+  size_t length = (size_t)(out - text);
+  spelling_ptr += length;
+  spelling_bytes += length;
+  stringified_count++;
+  return (struct MacroToken){
+    .value = { .begin = text, .length = length },
+    .type = STR_LITERAL_TOK,
+    .atom = -1,
+    .file_id = spelling_file_id,
+    .param = -1
+  };
+}
+
+// Room for the body of a macro with its operators applied: every parameter
+// may be replaced by its argument.
+static size_t applied_size(const struct Macro* macro,
+                           const struct MacroArg* args)
+{
+  size_t size = array_length(macro->body);
+  for(size_t i = 0; i < array_length(macro->body); i++) {
+    if(macro->body[i].param >= 0) size += args[macro->body[i].param].count;
+  }
+  return size;
+}
+
+static size_t apply_operators(const struct Macro* macro,
+                              const struct MacroToken* body, size_t count,
+                              const struct MacroArg* args, bool va_omitted,
+                              struct MacroToken* out);
+
+// The string #__VA_OPT__(...) makes: the count tokens inside the
+// parentheses with # and ## applied and the other parameters replaced by
+// their expanded arguments, as they would be in the body, or "" if the
+// variable arguments expand to nothing.
+static struct MacroToken stringify_va_opt(const struct Macro* macro,
+                                          const struct MacroToken* contents,
+                                          size_t count, struct MacroArg* args,
+                                          bool va_omitted)
+{
+  struct MacroArg replaced = { .tokens = NULL, .count = 0 };
+  if(!args[array_length(macro->params) - 1].expanded_count) {
+    return stringify(replaced);
+  }
+
+  size_t size = count;
+  for(size_t i = 0; i < count; i++) {
+    if(contents[i].param >= 0) size += args[contents[i].param].count;
+  }
+  struct MacroToken* applied = arena_alloc(&expansion_arena,
+                                           size * sizeof(struct MacroToken));
+  size_t n = apply_operators(macro, contents, count, args, va_omitted,
+                             applied);
+  size = 0;
+  for(size_t i = 0; i < n; i++) {
+    if(applied[i].param < 0) {
+      size++;
+      continue;
+    }
+    struct MacroArg* arg = &args[applied[i].param];
+    if(!arg->is_expanded) expand_argument(arg);
+    size += arg->expanded_count;
+  }
+  struct MacroToken* tokens = arena_alloc(&expansion_arena,
+                                          size * sizeof(struct MacroToken));
+  for(size_t i = 0; i < n; i++) {
+    if(applied[i].param < 0) {
+      tokens[replaced.count++] = applied[i];
+      continue;
+    }
+    const struct MacroArg* arg = &args[applied[i].param];
+    for(size_t k = 0; k < arg->expanded_count; k++) {
+      tokens[replaced.count] = arg->expanded[k];
+      if(k == 0) tokens[replaced.count].space = applied[i].space;
+      replaced.count++;
+    }
+  }
+  replaced.tokens = tokens;
+  return stringify(replaced);
+}
+
+// Replaces each __VA_OPT__(...) of a variadic macro's body with what is
+// inside the parentheses if the variable arguments expand to any tokens
+// and that is not empty, and otherwise with the __VA_OPT__ token alone, which
+// apply_operators takes as an empty operand. #__VA_OPT__(...) is replaced by the string it makes.
+// Returns the number of tokens written to out.
+static size_t apply_va_opt(const struct Macro* macro, struct MacroArg* args,
+                           bool va_omitted, struct MacroToken* out)
+{
+  const struct MacroToken* body = macro->body;
+  size_t count = array_length(body);
+  struct MacroArg* va_args = &args[array_length(macro->params) - 1];
+  if(!va_args->is_expanded) expand_argument(va_args);
+  size_t n = 0;
+  for(size_t i = 0; i < count; i++) {
+    bool hash = body[i].type == HASH_TOK && i + 1 < count
+                && body[i + 1].param == VA_OPT_PARAM;
+    if(body[i + hash].param != VA_OPT_PARAM) {
+      out[n++] = body[i];
+      continue;
+    }
+    size_t open = i + hash + 1;
+    size_t close = open + 1;
+    for(int depth = 0; depth || body[close].type != RPAREN_TOK; close++) {
+      if(body[close].type == LPAREN_TOK) depth++;
+      else if(body[close].type == RPAREN_TOK) depth--;
+    }
+    if(hash) {
+      out[n] = stringify_va_opt(macro, body + open + 1, close - open - 1,
+                                args, va_omitted);
+      out[n++].space = body[i].space;
+    } else if(!va_args->expanded_count || close == open + 1) {
+      out[n++] = body[i];
+    } else {
+      memcpy(out + n, body + i + 2, (close - i - 2) * sizeof(*out));
+      n += close - i - 2;
+    }
+    i = close;
+  }
+  return n;
+}
+
+// Applies the # and ## operators in count tokens of a macro's body for one
+// invocation and writes the body that results to out, returning its
+// length. # and ## take the argument of a parameter as it was passed; a
+// parameter that is not an operand is left as a slot, to be read from the
+// expanded arguments.
+//
+// As in GCC, a ',' pasted to empty variable arguments that were left out
+// entirely is deleted.
+static size_t apply_operators(const struct Macro* macro,
+                              const struct MacroToken* body, size_t count,
+                              const struct MacroArg* args, bool va_omitted,
+                              struct MacroToken* out)
+{
+  int va_param = macro->variadic ? (int)array_length(macro->params) - 1 : -1;
+  size_t n = 0;
+  bool empty = false; // The last operand was an empty argument
+  for(size_t i = 0; i < count; i++) {
+    bool paste = body[i].type == HASH_HASH_TOK;
+    if(paste && ++i == count) break;
+    const struct MacroToken* tok = &body[i];
+
+    struct MacroToken string;
+    struct MacroArg operand = { .tokens = tok, .count = 1 };
+    if(tok->type == HASH_TOK && macro->function_like) {
+      string = stringify(args[body[++i].param]);
+      operand.tokens = &string;
+    } else if(tok->param == VA_OPT_PARAM) {
+      operand.count = 0;
+    } else if(tok->param >= 0
+              && (paste || (i + 1 < count
+                            && body[i + 1].type == HASH_HASH_TOK))) {
+      operand = args[tok->param];
+    }
+
+    if(paste && tok->param == va_param && n && out[n - 1].type == COMMA_TOK) {
+      if(va_omitted) n--;
+      paste = false;
+    }
+
+    // An empty argument on either side of ## leaves the other as it is
+    size_t k = 0;
+    if(paste && !empty && operand.count && n) {
+      out[n - 1] = paste_tokens(&out[n - 1], &operand.tokens[0]);
+      k = 1;
+    }
+    for(; k < operand.count; k++) {
+      out[n] = operand.tokens[k];
+      if(k == 0) out[n].space = tok->space;
+      n++;
+    }
+    empty = paste ? empty && !operand.count : !operand.count;
+  }
+  return n;
+}
+
+// Writes the spelling of a builtin's value, which is key for the ones that
+// are numbers, to the spelling buffer.
+static void spell_builtin(enum BuiltinMacro builtin, long key,
+                          struct BuiltinSpelling* out)
+{
+  char* text = spelling_reserve(64);
+  size_t length = 0;
+  enum TType type = STR_LITERAL_TOK;
+  switch(builtin) {
+  case BUILTIN_FILE: {
+    const char* name = source_name((int)key);
+    size_t size = 2 * strlen(name) + 2;
+    text = spelling_reserve(size);
+    text[length++] = '"';
+    for(; *name; name++) {
+      if(*name == '"' || *name == '\\') text[length++] = '\\';
+      text[length++] = *name;
+    }
+    text[length++] = '"';
+    break;
+  }
+  case BUILTIN_DATE:
+    length = strftime(text, 64, "\"%b %e %Y\"", localtime(&translation_time));
+    break;
+  case BUILTIN_TIME:
+    length = strftime(text, 64, "\"%H:%M:%S\"", localtime(&translation_time));
+    break;
+  case BUILTIN_STDC_VERSION:
+    length = (size_t)snprintf(text, 64, "%ldL", key);
+    type = LONG_LITERAL_TOK;
+    break;
+  default:
+    length = (size_t)snprintf(text, 64, "%ld", key);
+    type = INT_LITERAL_TOK;
+    break;
+  }
+  spelling_ptr += length;
+  spelling_bytes += length;
+  builtins_spelled++;
+  *out = (struct BuiltinSpelling){
+    .value = { .begin = text, .length = length },
+    .type = type,
+    .file_id = spelling_file_id,
+    .key = key
+  };
+}
+
+// Replaces the name of a builtin with its value where it is expanded: the
+// line of the outermost macro invocation for __LINE__ and the file being
+// read for __FILE__.
+static void expand_builtin(enum BuiltinMacro builtin, struct Token* tok)
+{
+  long key;
+  switch(builtin) {
+  case BUILTIN_LINE: key = tok->line; break;
+  case BUILTIN_FILE: key = lexer->file_id; break;
+  case BUILTIN_COUNTER: key = builtin_counter++; break;
+  case BUILTIN_STDC_VERSION: key = 202311; break;
+  default: key = 1; break;
+  }
+  struct BuiltinSpelling* spelling = &builtin_spellings[builtin];
+  if(!spelling->value.begin || spelling->key != key) {
+    spell_builtin(builtin, key, spelling);
+  }
+  builtins_expanded++;
+  tok->value = spelling->value;
+  tok->type = spelling->type;
+  tok->atom = -1;
+  tok->file_id = spelling->file_id;
+}
+
+// Pushes the expansion of atom if it is a macro and, for a function-like
+// macro, its name is followed by an argument list. Returns whether it did,
+// in which case lexing goes on in the expansion. site is the name's token;
+// a builtin is replaced by its value there instead.
+//
+// Recursion is stopped with Prosser's hide sets: a name that came out of
+// its own expansion is not expanded again. The expansion of an object-like
+// macro is hidden from the macro and from whatever the name was hidden
+// from. For a function-like macro only what both the name and the closing
+// ')' were hidden from carries over.
+static bool expand_macro(struct Atom* atom, struct Token* site)
+{
+  if(!atom->is_macro || hideset_contains(site->hideset, atom->id)) {
+    return false;
+  }
+  if(atom->builtin) {
+    expand_builtin(atom->builtin, site);
+    return false;
+  }
+  struct Macro* macro = macro_table_get(&macroTable, atom->name, atom->hash);
+
+  if(!macro->function_like) {
+    const struct MacroToken* body = macro->body;
+    size_t count = array_length(macro->body);
+    pop_finished_frames();
+    struct ArenaMark mark = arena_mark(&expansion_arena);
+    if(macro->has_operators) {
+      struct MacroToken* applied = arena_alloc(&expansion_arena,
+                                               count * sizeof(struct MacroToken));
+      count = apply_operators(macro, body, count, NULL, false, applied);
+      body = applied;
+    }
+    if(count) {
+      lexer_push_tokens(mark, body, count, site,
+                        hideset_add(site->hideset, atom->id));
+    }
+    return true;
+  }
+
+  if(!match_lparen()) return false;
+  unsigned long directives = directive_count;
+  size_t first_token = array_length(scratch_tokens);
+  size_t first_arg = array_length(scratch_args);
+  int hideset = collect_arguments(array_length(macro->params),
+                                  macro->variadic, first_arg);
+  hideset = hideset_add(hideset_intersect(site->hideset, hideset), atom->id);
+  // Directives among the arguments may have changed the macro table and
+  // moved or freed the definition
+  if(directive_count != directives) {
+    macro = macro_table_get(&macroTable, atom->name, atom->hash);
+    if(!macro || !macro->function_like) {
+      error("Macro %.*s was undefined or made object-like among its own "
+            "arguments.",
+            (int)atom->name.length, atom->name.begin);
+    }
+  }
+
+  // () is one empty argument to a macro that has parameters, and the
+  // variable arguments may be left out altogether
+  size_t params = array_length(macro->params);
+  if(array_length(scratch_args) == first_arg && params) start_scratch_arg();
+  size_t arg_count = array_length(scratch_args) - first_arg;
+  bool va_omitted = macro->variadic
+                    && (arg_count + 1 == params
+                        || (params == 1
+                            && array_length(scratch_tokens) == first_token));
+  if(macro->variadic && arg_count + 1 == params) {
+    start_scratch_arg();
+    arg_count++;
+  }
+  if(arg_count != params) {
+    error("Macro %.*s takes %zu arguments but was given %zu.",
+          (int)atom->name.length, atom->name.begin, params, arg_count);
+  }
+
+  // The arguments are only moved into the arena now since collecting them
+  // can pop frames, releasing what was allocated after them.
+  pop_finished_frames();
+  struct ArenaMark mark = arena_mark(&expansion_arena);
+  size_t token_count = array_length(scratch_tokens) - first_token;
+  struct MacroToken* tokens = arena_alloc(&expansion_arena,
+                                          token_count * sizeof(struct MacroToken)
+                                          + arg_count * sizeof(struct MacroArg));
+  struct MacroArg* args = (struct MacroArg*)(tokens + token_count);
+  memcpy(tokens, scratch_tokens + first_token,
+         token_count * sizeof(struct MacroToken));
+  for(size_t i = 0; i < arg_count; i++) {
+    size_t begin = scratch_args[first_arg + i] - first_token;
+    size_t end = i + 1 < arg_count ? scratch_args[first_arg + i + 1] - first_token
+                                   : token_count;
+    args[i] = (struct MacroArg){ .tokens = tokens + begin,
+                                 .count = end - begin };
+  }
+  array_length(scratch_tokens) = first_token;
+  array_length(scratch_args) = first_arg;
+
+  const struct MacroToken* body = macro->body;
+  size_t body_count = array_length(macro->body);
+  if(macro->has_operators) {
+    struct MacroToken* applied = arena_alloc(&expansion_arena,
+        applied_size(macro, args) * sizeof(struct MacroToken));
+    if(macro->variadic) {
+      struct MacroToken* opted = arena_alloc(&expansion_arena,
+                                             body_count * sizeof(struct MacroToken));
+      body_count = apply_va_opt(macro, args, va_omitted, opted);
+      body = opted;
+    }
+    body_count = apply_operators(macro, body, body_count, args, va_omitted,
+                                 applied);
+    body = applied;
+  }
+  if(!body_count) {
+    arena_release(&expansion_arena, mark);
+    return true;
+  }
+  struct lexer* frame = lexer_push_tokens(mark, body, body_count, site,
+                                          hideset);
+  frame->args = args;
+  frame->arg_count = arg_count;
+  return true;
+}
+
+// Lexes one token into out, expanding macros. Pushing an expansion or
+// popping a finished frame changes the top of the lexer stack, and the loop
+// then starts over on the new top.
+static inline void lex_token(struct Token* out)
+{
+  for(;;) {
+    struct Atom* atom = lex_unexpanded(out);
+    if(atom && atom->is_macro && expand_macro(atom, out)) continue;
+    return;
+  }
+}
+
+// Whether a token of an argument may expand there: a macro's name that, if
+// the macro is function-like, is followed by '(' within the argument.
+static bool may_expand(const struct MacroToken* tok, const struct MacroToken* end)
+{
+  if(tok->atom < 0) return false;
+  struct Atom* atom = atom_get(tok->atom);
+  if(!atom->is_macro) return false;
+  return !atom->is_function_like || (tok + 1 < end && tok[1].type == LPAREN_TOK);
+}
+
+// Macro-expands an argument on its own, as if it were the rest of the
+// input, the first time its parameter is used, and keeps the result for
+// the other uses. The argument's tokens are read through a barrier frame
+// that ends the input where they end. An argument with nothing to expand
+// is its own expansion.
+static void expand_argument(struct MacroArg* arg)
+{
+  arg->is_expanded = true;
+  arg->expanded = arg->tokens;
+  arg->expanded_count = arg->count;
+  const struct MacroToken* end = arg->tokens + arg->count;
+  const struct MacroToken* tok = arg->tokens;
+  while(tok < end && !may_expand(tok, end)) tok++;
+  if(tok == end) return;
+
+  args_expanded++;
+  size_t first = array_length(expanded_tokens);
+  struct Token site = { .line = lexer->line, .position = lexer->position };
+  struct lexer* barrier = lexer_push_tokens(arena_mark(&expansion_arena),
+                                            arg->tokens, arg->count, &site, 0);
+  barrier->barrier = true;
+  for(;;) {
+    struct Token out;
+    lex_token(&out);
+    if(out.type == EOF_TOK) break;
+    append_token(&expanded_tokens, &out);
+  }
+  lexer_pop();
+
+  size_t count = array_length(expanded_tokens) - first;
+  struct MacroToken* tokens = arena_alloc(&expansion_arena,
+                                          count * sizeof(struct MacroToken));
+  memcpy(tokens, expanded_tokens + first, count * sizeof(struct MacroToken));
+  array_length(expanded_tokens) = first;
+  arg->expanded = tokens;
+  arg->expanded_count = count;
+}
+
+// Values in #if are computed in intmax_t or uintmax_t, with the usual
+// arithmetic conversions between the two.
+struct PPValue {
+  uintmax_t value;
+  bool is_unsigned;
+};
+
+struct PPParser {
+  const struct MacroToken* tok;
+  const struct MacroToken* end;
+  bool evaluate; // Unset in the operand skipped by &&, || or ?:
+};
+
+static const char pp_one[] = "1";
+static const char pp_zero[] = "0";
+
+static struct PPValue pp_conditional(struct PPParser* p);
+
+static inline struct PPValue pp_int(intmax_t value)
+{
+  return (struct PPValue){ .value = (uintmax_t)value, .is_unsigned = false };
+}
+
+static inline bool pp_match(struct PPParser* p, enum TType type)
+{
+  if(p->tok == p->end || p->tok->type != type) return false;
+  p->tok++;
+  return true;
+}
+
+static bool is_unsigned_literal(enum TType type)
+{
+  switch(type) {
+  case UNSIGNED_LITERAL_TOK: case UNSIGNED_HEX_LITERAL_TOK:
+  case UNSIGNED_OCT_LITERAL_TOK: case UNSIGNED_BIN_LITERAL_TOK:
+  case UNSIGNED_LONG_LITERAL_TOK: case UNSIGNED_LONG_HEX_LITERAL_TOK:
+  case UNSIGNED_LONG_OCT_LITERAL_TOK: case UNSIGNED_LONG_BIN_LITERAL_TOK:
+  case UNSIGNED_LONG_LONG_LITERAL_TOK: case UNSIGNED_LONG_LONG_HEX_LITERAL_TOK:
+  case UNSIGNED_LONG_LONG_OCT_LITERAL_TOK:
+  case UNSIGNED_LONG_LONG_BIN_LITERAL_TOK:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static struct PPValue pp_number(const struct MacroToken* tok)
+{
+  const char* s = tok->value.begin;
+  size_t n = tok->value.length;
+  unsigned base = 10;
+  size_t i = 0;
+  if(n > 1 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) base = 16, i = 2;
+  else if(n > 1 && s[0] == '0' && (s[1] == 'b' || s[1] == 'B')) base = 2, i = 2;
+  else if(s[0] == '0') base = 8;
+  uintmax_t value = 0;
+  for(; i < n; i++) {
+    char c = s[i];
+    if(c == '\'') continue; // Digit separator
+    unsigned digit = c >= '0' && c <= '9' ? (unsigned)(c - '0')
+                   : c >= 'a' && c <= 'f' ? (unsigned)(c - 'a' + 10)
+                   : c >= 'A' && c <= 'F' ? (unsigned)(c - 'A' + 10) : 16;
+    if(digit >= base) break; // The suffix
+    if(value > (UINTMAX_MAX - digit) / base) {
+      error("Integer constant %.*s is too large for #if.", (int)n, s);
+    }
+    value = value * base + digit;
+  }
+  return (struct PPValue){ .value = value,
+                           .is_unsigned = is_unsigned_literal(tok->type)
+                                          || value > INTMAX_MAX };
+}
+
+// The value of the first character of a character constant, which is a
+// plain char for one without a prefix.
+static struct PPValue pp_char(const struct MacroToken* tok)
+{
+  const char* s = memchr(tok->value.begin, '\'', tok->value.length);
+  s++;
+  unsigned value = (unsigned char)*s;
+  if(*s == '\\') {
+    char c = *++s;
+    switch(c) {
+    case 'n': value = '\n'; break;
+    case 't': value = '\t'; break;
+    case 'r': value = '\r'; break;
+    case 'a': value = '\a'; break;
+    case 'b': value = '\b'; break;
+    case 'f': value = '\f'; break;
+    case 'v': value = '\v'; break;
+    case 'x':
+      value = 0;
+      while(char_class(*++s) & CC_XDIGIT) {
+        value = value * 16
+                + (unsigned)(*s <= '9' ? *s - '0' : (*s | 0x20) - 'a' + 10);
+      }
+      break;
+    default:
+      if(c >= '0' && c <= '7') {
+        value = 0;
+        for(int k = 0; k < 3 && *s >= '0' && *s <= '7'; k++, s++) {
+          value = value * 8 + (unsigned)(*s - '0');
         }
-        token_value.length += 2;
-      } else if(peek() == '0' && peekNext() == '\'') {
-        advance();
-        advance();
-        token_value.length += 2;
-      } else if(match('x')) {
-        token_value.length++;
-        while(matchXDigit()) token_value.length++;
-        if(!match('\'')) error("Expected \' after hex value at line %i, position %i.\n", lexer->line, lexer->position);
-        token_value.length++;
       } else {
-        while(matchOne("01234567")) token_value.length++;
-        if(!match('\'')) error("Expected \' after octal value at line %i, position %i.\n", lexer->line, lexer->position);
-        token_value.length++;
+        value = (unsigned char)c;
       }
-    } else if(peekNext() == '\'') {
-      advance();
-      advance();
-      token_value.length = 3;
+    }
+  }
+  if(tok->type == CHAR_LITERAL_TOK) return pp_int((signed char)value);
+  return pp_int((intmax_t)value);
+}
+
+static struct PPValue pp_primary(struct PPParser* p)
+{
+  if(p->tok == p->end) error("Expected a value at the end of #if.");
+  const struct MacroToken* tok = p->tok++;
+  switch(tok->type) {
+  case LPAREN_TOK: {
+    struct PPValue value = pp_conditional(p);
+    while(pp_match(p, COMMA_TOK)) value = pp_conditional(p);
+    if(!pp_match(p, RPAREN_TOK)) error("Expected ) in #if.");
+    return value;
+  }
+  case PLUS_TOK:
+    return pp_primary(p);
+  case MINUS_TOK: {
+    struct PPValue value = pp_primary(p);
+    value.value = 0 - value.value;
+    return value;
+  }
+  case TILDE_TOK: {
+    struct PPValue value = pp_primary(p);
+    value.value = ~value.value;
+    return value;
+  }
+  case BANG_TOK:
+    return pp_int(!pp_primary(p).value);
+  case TRUE_TOK:
+    return pp_int(1);
+  case CHAR_LITERAL_TOK: case U8_CHAR_LITERAL_TOK: case U16_CHAR_LITERAL_TOK:
+  case U32_CHAR_LITERAL_TOK: case WIDE_CHAR_LITERAL_TOK:
+    return pp_char(tok);
+  default:
+    if(tok->type >= INT_LITERAL_TOK
+       && tok->type <= UNSIGNED_LONG_LONG_BIN_LITERAL_TOK) {
+      return pp_number(tok);
+    }
+    // What is left of identifiers and keywords after expansion is 0
+    if(tok->atom >= 0) return pp_int(0);
+    error("Unexpected %.*s in #if.", (int)tok->value.length, tok->value.begin);
+  }
+}
+
+static int pp_precedence(enum TType type)
+{
+  switch(type) {
+  case STAR_TOK: case SLASH_TOK: case MODULUS_TOK: return 10;
+  case PLUS_TOK: case MINUS_TOK: return 9;
+  case LSHIFT_TOK: case RSHIFT_TOK: return 8;
+  case LESS_TOK: case LESS_EQUAL_TOK:
+  case GREATER_TOK: case GREATER_EQUAL_TOK: return 7;
+  case EQUAL_EQUAL_TOK: case BANG_EQUAL_TOK: return 6;
+  case AND_TOK: return 5;
+  case CARROT_TOK: return 4;
+  case VERT_TOK: return 3;
+  case AND_AND_TOK: return 2;
+  case VERT_VERT_TOK: return 1;
+  default: return 0;
+  }
+}
+
+static struct PPValue pp_apply(struct PPParser* p, enum TType op,
+                               struct PPValue a, struct PPValue b)
+{
+  bool u = a.is_unsigned || b.is_unsigned;
+  intmax_t sa = (intmax_t)a.value, sb = (intmax_t)b.value;
+  switch(op) {
+  case STAR_TOK:
+    return (struct PPValue){ a.value * b.value, u };
+  case SLASH_TOK:
+  case MODULUS_TOK:
+    if(!b.value) {
+      if(p->evaluate) error("Division by zero in #if.");
+      return (struct PPValue){ 0, u };
+    }
+    if(u) return (struct PPValue){ op == SLASH_TOK ? a.value / b.value
+                                                   : a.value % b.value, u };
+    if(sa == INTMAX_MIN && sb == -1) {
+      return (struct PPValue){ op == SLASH_TOK ? a.value : 0, u };
+    }
+    return pp_int(op == SLASH_TOK ? sa / sb : sa % sb);
+  case PLUS_TOK:
+    return (struct PPValue){ a.value + b.value, u };
+  case MINUS_TOK:
+    return (struct PPValue){ a.value - b.value, u };
+  case LSHIFT_TOK:
+    return (struct PPValue){ b.value >= 64 ? 0 : a.value << b.value,
+                             a.is_unsigned };
+  case RSHIFT_TOK:
+    if(a.is_unsigned) {
+      return (struct PPValue){ b.value >= 64 ? 0 : a.value >> b.value, true };
+    }
+    return pp_int(sa >> (b.value >= 64 ? 63 : b.value));
+  case LESS_TOK:
+    return pp_int(u ? a.value < b.value : sa < sb);
+  case LESS_EQUAL_TOK:
+    return pp_int(u ? a.value <= b.value : sa <= sb);
+  case GREATER_TOK:
+    return pp_int(u ? a.value > b.value : sa > sb);
+  case GREATER_EQUAL_TOK:
+    return pp_int(u ? a.value >= b.value : sa >= sb);
+  case EQUAL_EQUAL_TOK:
+    return pp_int(a.value == b.value);
+  case BANG_EQUAL_TOK:
+    return pp_int(a.value != b.value);
+  case AND_TOK:
+    return (struct PPValue){ a.value & b.value, u };
+  case CARROT_TOK:
+    return (struct PPValue){ a.value ^ b.value, u };
+  case VERT_TOK:
+    return (struct PPValue){ a.value | b.value, u };
+  default:
+    return pp_int(0);
+  }
+}
+
+// Precedence climbing over the binary operators that bind tighter than
+// min_precedence allows.
+static struct PPValue pp_binary(struct PPParser* p, int min_precedence)
+{
+  struct PPValue left = pp_primary(p);
+  for(;;) {
+    if(p->tok == p->end) return left;
+    enum TType op = p->tok->type;
+    int precedence = pp_precedence(op);
+    if(precedence < min_precedence || !precedence) return left;
+    p->tok++;
+    if(op == AND_AND_TOK || op == VERT_VERT_TOK) {
+      bool evaluate = p->evaluate;
+      bool decided = op == AND_AND_TOK ? !left.value : left.value != 0;
+      p->evaluate = evaluate && !decided;
+      struct PPValue right = pp_binary(p, precedence + 1);
+      p->evaluate = evaluate;
+      left = pp_int(decided ? op == VERT_VERT_TOK : right.value != 0);
+      continue;
+    }
+    struct PPValue right = pp_binary(p, precedence + 1);
+    left = pp_apply(p, op, left, right);
+  }
+}
+
+static struct PPValue pp_conditional(struct PPParser* p)
+{
+  struct PPValue condition = pp_binary(p, 1);
+  if(!pp_match(p, QMARK_TOK)) return condition;
+  bool evaluate = p->evaluate;
+  p->evaluate = evaluate && condition.value;
+  struct PPValue a = pp_conditional(p);
+  while(pp_match(p, COMMA_TOK)) a = pp_conditional(p);
+  if(!pp_match(p, COLON_TOK)) error("Expected : after ? in #if.");
+  p->evaluate = evaluate && !condition.value;
+  struct PPValue b = pp_conditional(p);
+  p->evaluate = evaluate;
+  struct PPValue value = condition.value ? a : b;
+  value.is_unsigned = a.is_unsigned || b.is_unsigned;
+  return value;
+}
+
+// Replaces what defined or __has_include at tokens[*i] applies to with a
+// 1 or 0 token, and moves *i to the last token it used.
+static struct MacroToken pp_operator(const struct MacroToken* tokens,
+                                     size_t* i, size_t end)
+{
+  struct MacroToken result = tokens[*i];
+  size_t at = *i + 1;
+  bool paren = at < end && tokens[at].type == LPAREN_TOK;
+  at += paren;
+  bool value;
+  if(result.atom == defined_atom) {
+    if(at >= end || tokens[at].atom < 0) {
+      error("Expected a macro name after defined.");
+    }
+    value = atom_get(tokens[at].atom)->is_macro
+            || tokens[at].atom == has_include_atom;
+  } else {
+    if(!paren) error("Expected ( after __has_include.");
+    struct string_view name;
+    bool quoted = at < end && tokens[at].type == STR_LITERAL_TOK;
+    if(quoted) {
+      name = (struct string_view){ tokens[at].value.begin + 1,
+                                   tokens[at].value.length - 2 };
+    } else if(at < end && tokens[at].type == LESS_TOK) {
+      size_t close = at + 1;
+      while(close < end && tokens[close].type != GREATER_TOK) close++;
+      if(close == end) error("Expected > in __has_include.");
+      name.begin = tokens[at].value.begin + 1;
+      name.length = (size_t)(tokens[close].value.begin - name.begin);
+      at = close;
     } else {
-      error("Char literal on line %i, position %i not a valid char.\n", lexer->line, lexer->position);
+      error("Expected \"file\" or <file> in __has_include.");
     }
-    out->type = CHAR_LITERAL_TOK;
-  } else if(next == 'L' && peekNext() == '\'') {
-    out->type = WIDE_CHAR_LITERAL_TOK;
-  } else if(next == 'u' && peek() == '8' && peekNext() == '\'') {
-    out->type = U8_CHAR_LITERAL_TOK;
-  } else if(next == 'u' && peek() == '\'') {
-    out->type = U16_CHAR_LITERAL_TOK;
-  } else if(next == 'U' && peek() == '\'') {
-    out->type = U32_CHAR_LITERAL_TOK;
-  } else if(match('"')) {
-    lex_string(&token_value);
-    out->type = STR_LITERAL_TOK;
-  } else if(isdigit(peek()) || (peek() == '.' && isdigit(peekNext()))) {
-    out->type = lex_number(&token_value);
-  } else if(matchAlpha() || match('_')) {
-    out->type = lex_identifier_or_keyword(&token_value);
-  } else if(ispunct(peek())) {
-    out->type = lex_operator(&token_value);
-  } else error("Line %i, Location %i: Unreconized token.", lexer->line, lexer->position);
+    value = name.length && include_exists(name, quoted, lexer->file_id);
+  }
+  if(paren && (++at >= end || tokens[at].type != RPAREN_TOK)) {
+    error("Expected ) after %.*s.", (int)result.value.length,
+          result.value.begin);
+  }
+  *i = at;
+  result.type = INT_LITERAL_TOK;
+  result.atom = -1;
+  result.value = (struct string_view){ (char*)(value ? pp_one : pp_zero), 1 };
+  return result;
+}
 
-  lexer->position += (int)token_value.length;
+// Evaluates the controlling expression of an #if or #elif and consumes the
+// rest of its line, the newline last so that errors point at the line.
+// defined and __has_include are applied first, then the line is
+// macro-expanded through a barrier frame like an argument is, and what
+// identifiers are left count as 0.
+static bool eval_if_line()
+{
+  conditions_evaluated++;
+  size_t base = array_length(scratch_tokens);
+  for(;;) {
+    size_t start = lexer->buffer_loc;
+    skip_directive_space();
+    if(peek() == '\n' || isAtEnd()) break;
+    if(lexer->next_splice < lexer->splice_count) count_splices();
+    bool space = lexer->buffer_loc != start;
+    struct Token tok;
+    lex_one(&tok);
+    tok.space = space;
+    tok.hideset = 0;
+    append_token(&scratch_tokens, &tok);
+  }
+  struct Token site = { .line = lexer->line, .position = lexer->position };
+
+  size_t end = array_length(scratch_tokens);
+  size_t count = 0;
+  for(size_t i = base; i < end; i++) {
+    struct MacroToken tok = scratch_tokens[i];
+    if(tok.atom >= 0
+       && (tok.atom == defined_atom || tok.atom == has_include_atom)) {
+      tok = pp_operator(scratch_tokens, &i, end);
+    }
+    scratch_tokens[base + count++] = tok;
+  }
+  if(!count) error("#if with no expression.");
+
+  struct ArenaMark mark = arena_mark(&expansion_arena);
+  struct MacroToken* line = arena_alloc(&expansion_arena,
+                                        count * sizeof(struct MacroToken));
+  memcpy(line, scratch_tokens + base, count * sizeof(struct MacroToken));
+  array_length(scratch_tokens) = base;
+
+  size_t first = array_length(expanded_tokens);
+  struct lexer* barrier = lexer_push_tokens(mark, line, count, &site, 0);
+  barrier->barrier = true;
+  for(;;) {
+    struct Token out;
+    lex_token(&out);
+    if(out.type == EOF_TOK) break;
+    append_token(&expanded_tokens, &out);
+  }
+  lexer_pop();
+
+  struct PPParser p = { .tok = expanded_tokens + first,
+                        .end = expanded_tokens + array_length(expanded_tokens),
+                        .evaluate = true };
+  struct PPValue value = pp_conditional(&p);
+  if(p.tok != p.end) {
+    error("Unexpected %.*s in #if.", (int)p.tok->value.length,
+          p.tok->value.begin);
+  }
+  array_length(expanded_tokens) = first;
+  match('\n');
+  lexer->line++;
+  lexer->position = 1;
+  return value.value != 0;
+}
 
-  out->file = strdup(lexer->current_file);
-  out->value = token_value;
+void cleanup_lexer()
+{
+  macro_table_destroy(&macroTable);
+  array_free(scratch_tokens);
+  array_free(scratch_args);
+  array_free(expanded_tokens);
+  scratch_tokens = NULL;
+  scratch_args = NULL;
+  expanded_tokens = NULL;
+  arg_uses = 0;
+  args_expanded = 0;
+  builtins_expanded = 0;
+  builtins_spelled = 0;
+  array_free(include_infos);
+  include_infos = NULL;
+  include_free();
+  array_free(conditionals);
+  conditionals = NULL;
+  conditions_evaluated = 0;
+  groups_skipped = 0;
+  bytes_skipped = 0;
+  include_depth = 0;
+  includes_read = 0;
+  includes_skipped = 0;
+  include_seconds_saved = 0;
+  spelling_ptr = NULL;
+  spelling_end = NULL;
+  spelling_file_id = -1;
+  map_free(&pasted_spellings);
+  pasted_count = 0;
+  stringified_count = 0;
+  spelling_bytes = 0;
+  atoms_free();
+  hidesets_free();
+  arena_free(&unit_arena);
+  arena_free(&expansion_arena);
+  source_release_all();
+  lexer = NULL;
+}
+
+static void print_arena_stats(const char* name, struct Arena* arena)
+{
+  printf("%s arena: %lu allocations, %lu bytes, %lu mallocs\n", name,
+         arena->stats.allocations, arena->stats.bytes, arena->stats.chunks);
+}
+
+void print_lexer_stats()
+{
+  print_arena_stats("unit", &unit_arena);
+  print_arena_stats("expansion", &expansion_arena);
+  struct MapStats macros;
+  map_stats(&macroTable, &macros);
+  printf("macro table: %zu macros, %zu tombstones, capacity %zu, "
+         "probe mean %.2f max %zu\n", macros.count, macros.tombstones,
+         macros.capacity, macros.mean_probe, macros.max_probe);
+  struct HideSetStats hidesets;
+  hideset_stats(&hidesets);
+  printf("hide sets: %zu sets, %lu cached operations, %lu computed\n",
+         hidesets.sets, hidesets.cache_hits, hidesets.cache_misses);
+  printf("spellings: %lu pastes, %zu distinct, %lu strings, %lu bytes\n",
+         pasted_count, pasted_spellings.count, stringified_count,
+         spelling_bytes);
+  printf("arguments: %lu uses, %lu expanded\n", arg_uses, args_expanded);
+  printf("builtins: %lu expanded, %lu spelled\n", builtins_expanded,
+         builtins_spelled);
+  printf("includes: %lu read, %lu skipped as guarded, %.3f ms saved\n",
+         includes_read, includes_skipped, include_seconds_saved * 1e3);
+  struct IncludeStats includes;
+  include_stats(&includes);
+  printf("include lookups: %lu, %lu cached, %lu not found, "
+         "%lu directories listed with %lu entries (%lu stated)\n",
+         includes.lookups, includes.cache_hits, includes.not_found,
+         includes.dirs_listed, includes.entries, includes.entries_stated);
+  struct SourceStats files;
+  source_stats(&files);
+  printf("files: %lu opened, %lu shared, %lu syscalls, %lu spliced with "
+         "%lu bytes rewritten\n", files.opened, files.shared, files.syscalls,
+         files.spliced, files.splice_bytes);
+  printf("conditionals: %lu evaluated, %lu groups skipped with %lu bytes\n",
+         conditions_evaluated, groups_skipped, bytes_skipped);
+  struct PrefetchStats prefetch;
+  prefetch_stats(&prefetch);
+  printf("prefetch: %lu files asked for, %lu read with %lu bytes, "
+         "%lu then included\n", prefetch.files_requested, prefetch.files_read,
+         prefetch.bytes_read, includes.prefetched_used);
+}
+
+bool get_next_token(struct Token* out)
+{
+  if(!out) return 0;
+
+  lex_token(out);
 #warning Test warning
   return out->type != EOF_TOK;
 }
+
+void token_stream_init(struct TokenStream* ts)
+{
+  *ts = (struct TokenStream){0};
+}
+
+void token_stream_free(struct TokenStream* ts)
+{
+  free(ts->types);
+  free(ts->file_ids);
+  free(ts->offsets);
+  free(ts->lengths);
+  free(ts->lines);
+  free(ts->positions);
+  free(ts->atoms);
+  token_stream_init(ts);
+}
+
+void token_stream_clear(struct TokenStream* ts)
+{
+  ts->count = 0;
+}
+
+static void token_stream_reserve(struct TokenStream* ts, size_t capacity)
+{
+  if(capacity <= ts->capacity) return;
+  if(capacity < 2 * ts->capacity) capacity = 2 * ts->capacity;
+  ts->types = realloc(ts->types, capacity * sizeof(*ts->types));
+  ts->file_ids = realloc(ts->file_ids, capacity * sizeof(*ts->file_ids));
+  ts->offsets = realloc(ts->offsets, capacity * sizeof(*ts->offsets));
+  ts->lengths = realloc(ts->lengths, capacity * sizeof(*ts->lengths));
+  ts->lines = realloc(ts->lines, capacity * sizeof(*ts->lines));
+  ts->positions = realloc(ts->positions, capacity * sizeof(*ts->positions));
+  ts->atoms = realloc(ts->atoms, capacity * sizeof(*ts->atoms));
+  if(!ts->types || !ts->file_ids || !ts->offsets || !ts->lengths
+     || !ts->lines || !ts->positions || !ts->atoms) {
+    error("Failed to allocate token stream of %zu tokens.", capacity);
+  }
+  ts->capacity = capacity;
+}
+
+size_t lex_tokens(struct TokenStream* ts, size_t max_tokens)
+{
+  size_t start = ts->count;
+  token_stream_reserve(ts, start + max_tokens);
+  int file_id = -1;
+  const char* base = NULL;
+
+  while(ts->count - start < max_tokens) {
+    struct Token tok;
+    lex_token(&tok);
+    if(tok.type == EOF_TOK) break;
+
+    size_t i = ts->count++;
+    ts->types[i] = tok.type;
+    ts->file_ids[i] = tok.file_id;
+    if(tok.file_id != file_id) {
+      file_id = tok.file_id;
+      base = source_get(file_id)->buffer;
+    }
+    ts->offsets[i] = (uint32_t)(tok.value.begin - base);
+    ts->lengths[i] = (uint32_t)tok.value.length;
+    ts->lines[i] = tok.line;
+    ts->positions[i] = tok.position;
+    ts->atoms[i] = tok.atom;
+  }
+  return ts->count - start;
+}
@@ -1,105 +1,40 @@
 #include "array.h"
 #include "compiler.h"
 
-#include <ctype.h>
 #include <stdbool.h>
 #include <stddef.h>
-#include <stdlib.h>
-#include <string.h>
 
-#include <stdio.h>
-
-struct Macro macro_copy(struct Macro to_copy) {
-  struct Macro copy = to_copy;
-  copy.arg_names = array_new();
-  array_capacity(copy.arg_names) = 0;
-  array_length(copy.arg_names) = 0;
-  array_sv_ensure(&copy.arg_names, array_length(to_copy.arg_names));
-  for(unsigned long i = 0; i < array_length(to_copy.arg_names); i++) {
-    array_sv_append(&(copy.arg_names), to_copy.arg_names[i]);
-  }
-  return copy;
-}
-
-static inline int arg_index(Array(struct string_view) names, struct string_view name)
+static inline int arg_index(Array(int) params, int atom)
 {
-  for(size_t i = 0; i < array_length(names); ++i) {
-    if(!strviewcmp(names[i], name)) return (int)i;
+  for(size_t i = 0; i < array_length(params); ++i) {
+    if(params[i] == atom) return (int)i;
   }
   return -1;
 }
 
-char* macro_expand(struct Macro macro, Array(struct string_view) arguments)
+static inline bool is_va_opt(int atom)
 {
-  size_t length = 0;
-  length += macro.text.length; // Will overestimate final length, but that's fine
-  for(size_t i = 0; i < array_length(arguments); ++i) {
-    length += arguments[i].length;
-  }
-
-  char* expansion = malloc(length * sizeof(char));
+  return !strviewstrcmp(atom_get(atom)->name, "__VA_OPT__");
+}
 
-  size_t count = 0;
-  bool inIdent = false;
-  struct string_view ident = {0};
-  for(size_t i = 0; i < macro.text.length; ++i) {
-    char c = macro.text.begin[i];
-    if((!isalnum(c) && c != '_') || (!inIdent && isdigit(c))) {
-      if(inIdent) {
-        int index = arg_index(macro.arg_names, ident);
-        if(index >= 0) {
-          if(count + arguments[index].length >= length) {
-            length = 3 * length / 2;
-            expansion = realloc(expansion, length);
-          }
-          strncpy(expansion + count, arguments[index].begin, arguments[index].length);
-          count += arguments[index].length;
-        } else {
-          if(count + ident.length >= length) {
-            length = 3 * length / 2;
-            expansion = realloc(expansion, length);
-          }
-          strncpy(expansion + count, ident.begin, ident.length);
-          count += ident.length;
-        }
-        inIdent = false;
-        ident.length = 0;
-      }
-      if(count + 1 >= length) {
-        length = 3 * length / 2;
-        expansion = realloc(expansion, length);
-      }
-      expansion[count++] = c;
-      continue;
+// Marks the body tokens that name a parameter with its slot, so expanding
+// the macro never has to look the names up again, and notes whether the
+// body uses # or ##, or __VA_OPT__ in a variadic macro. # is only an
+// operator in a function-like macro.
+void macro_resolve_params(struct Macro* macro)
+{
+  macro->has_operators = false;
+  for(size_t i = 0; i < array_length(macro->body); i++) {
+    struct MacroToken* tok = &macro->body[i];
+    tok->param = macro->params && tok->atom >= 0
+                 ? arg_index(macro->params, tok->atom) : -1;
+    if(macro->variadic && tok->param < 0 && tok->atom >= 0
+       && is_va_opt(tok->atom)) {
+      tok->param = VA_OPT_PARAM;
     }
-    inIdent = true;
-    if(ident.length == 0) ident.begin = &macro.text.begin[i];
-    ident.length++;
-  }
-  if(inIdent) {
-    int index = arg_index(macro.arg_names, ident);
-    if(index >= 0) {
-      if(count + arguments[index].length >= length) {
-        length = 2 * length;
-        expansion = realloc(expansion, length);
-      }
-      strncpy(expansion + count, arguments[index].begin, arguments[index].length);
-      count += arguments[index].length;
-    } else {
-      if(count + ident.length >= length) {
-        length = 2 * length;
-        expansion = realloc(expansion, length);
-      }
-      strncpy(expansion + count, ident.begin, ident.length);
-      count += ident.length;
+    if(tok->type == HASH_HASH_TOK || tok->param == VA_OPT_PARAM
+       || (tok->type == HASH_TOK && macro->function_like)) {
+      macro->has_operators = true;
     }
   }
-  
-  if(count + 1 >= length) {
-    length = count + 1;
-    expansion = realloc(expansion, length);
-  }
-  expansion[count] = '\0';
-  return expansion;
 }
-
@@ -1,7 +1,11 @@
 #include "compiler.h"
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
 
 static _Noreturn void error(char* msg)
 {
@@ -9,17 +13,89 @@ static _Noreturn void error(char* msg)
   abort();
 }
 
+static double now_seconds()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// Lexes the whole file without printing and reports throughput, wall time
+// and peak RSS. With batch set, tokens are lexed in chunks into a token
+// stream instead of one get_next_token call each.
+static void bench(const char* filename, bool batch, bool stats)
+{
+  double start = now_seconds();
+  setup_lexer(filename);
+  unsigned long count = 0;
+  if(batch) {
+    struct TokenStream ts;
+    token_stream_init(&ts);
+    size_t n;
+    while((n = lex_tokens(&ts, 4096))) {
+      count += n;
+      token_stream_clear(&ts);
+    }
+    token_stream_free(&ts);
+  } else {
+    struct Token tok;
+    while(get_next_token(&tok)) count++;
+  }
+  double elapsed = now_seconds() - start;
+
+  size_t bytes = 0;
+  for(int i = 0; i < source_count(); i++) {
+    if(source_get(i)->kind == SOURCE_FILE) bytes += source_get(i)->size;
+  }
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  long peak_kb = usage.ru_maxrss / 1024;
+#else
+  long peak_kb = usage.ru_maxrss;
+#endif
+  printf("%lu tokens in %.3f s (%.0f tokens/s, %.1f MB/s), peak RSS %ld KB\n",
+         count, elapsed, (double)count / elapsed,
+         (double)bytes / elapsed / 1e6, peak_kb);
+  if(stats) print_lexer_stats();
+  cleanup_lexer();
+}
+
 int main(int argc, char* argv[])
 {
-  if(argc != 2) {
+  bool bench_mode = false;
+  bool batch = false;
+  bool stats = false;
+  const char* filename = NULL;
+  for(int i = 1; i < argc; i++) {
+    if(!strcmp(argv[i], "--bench")) bench_mode = true;
+    else if(!strcmp(argv[i], "--batch")) batch = true;
+    else if(!strcmp(argv[i], "--stats")) stats = true;
+    else if(!strcmp(argv[i], "--prefetch")) prefetch_enable(true);
+    else if(!strncmp(argv[i], "-I", 2)) {
+      if(argv[i][2]) add_include_dir(argv[i] + 2);
+      else if(i + 1 < argc) add_include_dir(argv[++i]);
+      else error("Expected a directory after -I.");
+    }
+    else if(!filename) filename = argv[i];
+    else error("Expected exactly 1 file to compile.");
+  }
+  if(!filename) {
     error("Expected exactly 1 argument, the file to compile.");
   }
-  printf("Hello, World! Will compile %s.\n", argv[1]);
-  setup_lexer(argv[1]);
+  if(bench_mode) {
+    bench(filename, batch, stats);
+    return 0;
+  }
+  printf("Hello, World! Will compile %s.\n", filename);
+  setup_lexer(filename);
   struct Token tok;
   while(get_next_token(&tok)) {
     print_strview(tok.value);
     printf(" at line: %i, column: %i\n", tok.line, tok.position);
   }
+  if(stats) print_lexer_stats();
+  cleanup_lexer();
   return 0;
 }
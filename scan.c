@@ -0,0 +1,165 @@
+#include "scan.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+static inline size_t scan_find3_tail(const char* p, size_t i, size_t n,
+                                     char a, char b, char c)
+{
+  for(; i + 8 <= n; i += 8) {
+    uint64_t word = swar_load(p + i);
+    uint64_t hits = swar_eq(word, a) | swar_eq(word, b) | swar_eq(word, c);
+    if(hits) return i + swar_first(hits);
+  }
+  for(; i < n; i++) {
+    if(p[i] == a || p[i] == b || p[i] == c) return i;
+  }
+  return n;
+}
+
+size_t scan_find3(const char* p, size_t n, char a, char b, char c)
+{
+  size_t i = 0;
+#if defined(__AVX2__)
+  const __m256i va = _mm256_set1_epi8(a);
+  const __m256i vb = _mm256_set1_epi8(b);
+  const __m256i vc = _mm256_set1_epi8(c);
+  for(; i + 32 <= n; i += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i*)(p + i));
+    __m256i hits = _mm256_or_si256(
+      _mm256_or_si256(_mm256_cmpeq_epi8(chunk, va), _mm256_cmpeq_epi8(chunk, vb)),
+      _mm256_cmpeq_epi8(chunk, vc));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(hits);
+    if(mask) return i + (size_t)__builtin_ctz(mask);
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i xa = _mm_set1_epi8(a);
+  const __m128i xb = _mm_set1_epi8(b);
+  const __m128i xc = _mm_set1_epi8(c);
+  for(; i + 16 <= n; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)(p + i));
+    __m128i hits = _mm_or_si128(
+      _mm_or_si128(_mm_cmpeq_epi8(chunk, xa), _mm_cmpeq_epi8(chunk, xb)),
+      _mm_cmpeq_epi8(chunk, xc));
+    unsigned mask = (unsigned)_mm_movemask_epi8(hits);
+    if(mask) return i + (size_t)__builtin_ctz(mask);
+  }
+#endif
+  return scan_find3_tail(p, i, n, a, b, c);
+}
+
+size_t scan_find_comment_end(const char* p, size_t n)
+{
+  if(n < 2) return n;
+  size_t i = 0;
+  // Compare each block against '*' and the block one byte later against
+  // '/', so a hit marks the '*' of a "*/" pair.
+#if defined(__AVX2__)
+  const __m256i vstar = _mm256_set1_epi8('*');
+  const __m256i vslash = _mm256_set1_epi8('/');
+  for(; i + 33 <= n; i += 32) {
+    __m256i star = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + i)), vstar);
+    __m256i slash = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + i + 1)), vslash);
+    unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(star, slash));
+    if(mask) return i + (size_t)__builtin_ctz(mask);
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i xstar = _mm_set1_epi8('*');
+  const __m128i xslash = _mm_set1_epi8('/');
+  for(; i + 17 <= n; i += 16) {
+    __m128i star = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + i)), xstar);
+    __m128i slash = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + i + 1)), xslash);
+    unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(star, slash));
+    if(mask) return i + (size_t)__builtin_ctz(mask);
+  }
+#endif
+  for(; i + 9 <= n; i += 8) {
+    uint64_t hits = swar_eq(swar_load(p + i), '*') & swar_eq(swar_load(p + i + 1), '/');
+    if(hits) return i + swar_first(hits);
+  }
+  for(; i + 1 < n; i++) {
+    if(p[i] == '*' && p[i + 1] == '/') return i;
+  }
+  return n;
+}
+
+size_t scan_find_splice(const char* p, size_t n)
+{
+  if(n < 2) return n;
+  size_t i = 0;
+#if defined(__AVX2__)
+  const __m256i vback = _mm256_set1_epi8('\\');
+  const __m256i vnl = _mm256_set1_epi8('\n');
+  const __m256i vcr = _mm256_set1_epi8('\r');
+  for(; i + 33 <= n; i += 32) {
+    __m256i back = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + i)), vback);
+    __m256i next = _mm256_loadu_si256((const __m256i*)(p + i + 1));
+    __m256i eol = _mm256_or_si256(_mm256_cmpeq_epi8(next, vnl), _mm256_cmpeq_epi8(next, vcr));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(back, eol));
+    if(mask) return i + (size_t)__builtin_ctz(mask);
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i xback = _mm_set1_epi8('\\');
+  const __m128i xnl = _mm_set1_epi8('\n');
+  const __m128i xcr = _mm_set1_epi8('\r');
+  for(; i + 17 <= n; i += 16) {
+    __m128i back = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + i)), xback);
+    __m128i next = _mm_loadu_si128((const __m128i*)(p + i + 1));
+    __m128i eol = _mm_or_si128(_mm_cmpeq_epi8(next, xnl), _mm_cmpeq_epi8(next, xcr));
+    unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(back, eol));
+    if(mask) return i + (size_t)__builtin_ctz(mask);
+  }
+#endif
+  for(; i + 9 <= n; i += 8) {
+    uint64_t next = swar_load(p + i + 1);
+    uint64_t hits = swar_eq(swar_load(p + i), '\\')
+                  & (swar_eq(next, '\n') | swar_eq(next, '\r'));
+    if(hits) return i + swar_first(hits);
+  }
+  for(; i + 1 < n; i++) {
+    if(p[i] == '\\' && (p[i + 1] == '\n' || p[i + 1] == '\r')) return i;
+  }
+  return n;
+}
+
+size_t scan_count_lines(const char* p, size_t n, size_t* last)
+{
+  size_t count = 0;
+  size_t i = 0;
+#if defined(__AVX2__)
+  const __m256i vnl = _mm256_set1_epi8('\n');
+  for(; i + 32 <= n; i += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i*)(p + i));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, vnl));
+    if(mask) {
+      count += (size_t)__builtin_popcount(mask);
+      *last = i + 31 - (size_t)__builtin_clz(mask);
+    }
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i xnl = _mm_set1_epi8('\n');
+  for(; i + 16 <= n; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)(p + i));
+    unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, xnl));
+    if(mask) {
+      count += (size_t)__builtin_popcount(mask);
+      *last = i + 31 - (size_t)__builtin_clz(mask);
+    }
+  }
+#endif
+  for(; i < n; i++) {
+    if(p[i] == '\n') {
+      count++;
+      *last = i;
+    }
+  }
+  return count;
+}
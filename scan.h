@@ -0,0 +1,144 @@
+#ifndef Scan_H
+#define Scan_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Word-at-a-time helpers. Each works on 8 bytes in memory order and returns
+// a mask with the high bit of every byte that passed the test set.
+#define SWAR_ONES 0x0101010101010101ull
+#define SWAR_HIGH 0x8080808080808080ull
+
+static inline uint64_t swar_load(const char* p)
+{
+  uint64_t word;
+  memcpy(&word, p, sizeof(word));
+  return word;
+}
+
+// Index of the first byte whose high bit is set in mask, which must be
+// non-zero.
+static inline size_t swar_first(uint64_t mask)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  return (size_t)__builtin_clzll(mask) / 8;
+#else
+  return (size_t)__builtin_ctzll(mask) / 8;
+#endif
+}
+
+static inline uint64_t swar_eq(uint64_t word, char c)
+{
+  uint64_t x = word ^ (SWAR_ONES * (unsigned char)c);
+  uint64_t low = ~SWAR_HIGH;
+  return ~(((x & low) + low) | x | low);
+}
+
+// Bytes in [A-Za-z0-9_]. Range checks add a bias so that the high bit of a
+// byte flips at the range boundary; bytes >= 0x80 are masked out first so
+// the additions never carry between bytes.
+static inline uint64_t swar_ident(uint64_t word)
+{
+#define SWAR_GE(w, c) ((w) + SWAR_ONES * (128 - (c)))
+#define SWAR_GT(w, c) ((w) + SWAR_ONES * (127 - (c)))
+  uint64_t ascii = ~word & SWAR_HIGH;
+  uint64_t w = word & ~SWAR_HIGH;
+  uint64_t digit = SWAR_GE(w, '0') & ~SWAR_GT(w, '9');
+  uint64_t upper = SWAR_GE(w, 'A') & ~SWAR_GT(w, 'Z');
+  uint64_t lower = SWAR_GE(w, 'a') & ~SWAR_GT(w, 'z');
+  uint64_t under = ~((w ^ (SWAR_ONES * '_')) + SWAR_ONES * 127);
+  return (digit | upper | lower | under) & ascii;
+#undef SWAR_GE
+#undef SWAR_GT
+}
+
+// The first n bytes of word, n < 8, with the rest zeroed: the same value as
+// copying those n bytes into a zeroed word.
+static inline uint64_t swar_prefix(uint64_t word, size_t n)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  return n ? word & (~0ull << (64 - 8 * n)) : 0;
+#else
+  return word & ((1ull << (8 * n)) - 1);
+#endif
+}
+
+// Loads the n < 8 bytes at p into a word as swar_prefix would leave them,
+// without reading past p + n. Two overlapping 4-byte loads cover n >= 4;
+// below that the first, middle and last bytes do.
+static inline uint64_t swar_load_partial(const char* p, size_t n)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define SWAR_BYTE_SHIFT(i) (56 - 8 * (i))
+#else
+#define SWAR_BYTE_SHIFT(i) (8 * (i))
+#endif
+  if(n >= 4) {
+    uint32_t lo, hi;
+    memcpy(&lo, p, sizeof(lo));
+    memcpy(&hi, p + n - 4, sizeof(hi));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return (uint64_t)lo << 32 | (uint64_t)hi << (64 - 8 * n);
+#else
+    return (uint64_t)lo | (uint64_t)hi << (8 * (n - 4));
+#endif
+  }
+  if(n == 0) return 0;
+  return (uint64_t)(unsigned char)p[0] << SWAR_BYTE_SHIFT(0)
+       | (uint64_t)(unsigned char)p[n / 2] << SWAR_BYTE_SHIFT(n / 2)
+       | (uint64_t)(unsigned char)p[n - 1] << SWAR_BYTE_SHIFT(n - 1);
+#undef SWAR_BYTE_SHIFT
+}
+
+// Whether the n bytes at a and b are the same, reading no further than
+// memcmp would. Meant for short keys such as identifiers, where a call to
+// memcmp costs more than the compare.
+static inline int swar_equal(const char* a, const char* b, size_t n)
+{
+  for(; n >= 8; n -= 8, a += 8, b += 8) {
+    if(swar_load(a) != swar_load(b)) return 0;
+  }
+  return swar_load_partial(a, n) == swar_load_partial(b, n);
+}
+
+// Identifier hash, one word at a time. strview_hash and the lexer's
+// identifier scanner both build it from these and must agree: the last
+// word, if partial, is taken with swar_prefix.
+#define HASH_SEED 0x243f6a8885a308d3ull
+
+static inline uint64_t hash_word(uint64_t hash, uint64_t word)
+{
+  hash = (hash ^ word) * 0x9e3779b97f4a7c15ull;
+  return hash ^ (hash >> 29);
+}
+
+static inline uint64_t hash_finish(uint64_t hash, size_t length)
+{
+  hash ^= length;
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdull;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ull;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+// Buffer scanning kernels. They use AVX2 or SSE2 where the compiler targets
+// it and SWAR otherwise, and never read past p + n.
+
+// Offset of the first byte in [p, p + n) equal to a, b or c, or n if none.
+size_t scan_find3(const char* p, size_t n, char a, char b, char c);
+
+// Offset of the first "*/" in [p, p + n), or n if none.
+size_t scan_find_comment_end(const char* p, size_t n);
+
+// Offset of the first backslash in [p, p + n) followed by a newline or a
+// carriage return, or n if none. Callers check for "\\\r\n" themselves.
+size_t scan_find_splice(const char* p, size_t n);
+
+// Number of newlines in [p, p + n). If there are any, *last is set to the
+// offset of the last one.
+size_t scan_count_lines(const char* p, size_t n, size_t* last);
+
+#endif
@@ -0,0 +1,347 @@
+#include "compiler.h"
+#include "array.h"
+#include "scan.h"
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Every name a file has been loaded under, with what identifies the file,
+// so that another name for it, such as through a symlink or "..", finds
+// the same source instead of loading it again.
+struct LoadedFile {
+  const char* name; // Owned here unless it is the name of the source
+  int id;
+  dev_t dev;
+  ino_t ino;
+  time_t mtime;
+  off_t size;
+};
+
+static Array(struct SourceFile) sources = NULL;
+static Array(struct LoadedFile) loaded = NULL;
+// System calls are counted one per call made here
+static struct SourceStats stats;
+
+_Noreturn
+static void error(const char* msg, ...)
+{
+  fprintf(stderr, "Source Error: ");
+  va_list ap;
+  va_start(ap, msg);
+  vfprintf(stderr, msg, ap);
+  va_end(ap);
+  fputc('\n', stderr);
+  abort();
+}
+
+static void source_read_file(struct SourceFile* source, FILE* file)
+{
+  stats.syscalls += 5; // Seeking to the end and back, reading, closing
+  int err = fseek(file, 0L, SEEK_END);
+  if(err) {
+    fclose(file);
+    error("Error seeking end of file %s.\n", source->name);
+  }
+  long ftell_ret = ftell(file);
+  if(ftell_ret == -1L) {
+    fclose(file);
+    error("Error getting end position of file %s from ftell.\n", source->name);
+  }
+  size_t size = (size_t)ftell_ret;
+  rewind(file);
+
+  source->buffer = malloc((size+1)*sizeof(char));
+  if(!source->buffer) {
+    fclose(file);
+    error("Failed to allocate enough memory to read in file. Need %zu bytes.\n", size);
+  }
+
+  size_t bytes_read = fread(source->buffer, sizeof(char), size, file);
+  int eof = feof(file);
+  int ferr = ferror(file);
+  fclose(file);
+  if(bytes_read != size) {
+    if(eof) {
+      error("Unexpected EOF %f%% of the way through (%zu of %zu bytes).\n", 100.0 * ((double)bytes_read / (double)size), bytes_read, size);
+    } else if (ferr){
+      error("Error reading in %s.\n", source->name);
+    } else {
+      error("Read in fewer bytes (%zu) than expected (%zu). No error or EOF reported.\n", bytes_read, size);
+    }
+  }
+  source->buffer[size] = '\0';
+  source->size = size;
+  source->map_size = 0;
+}
+
+// Maps a regular file read-only. The mapping is placed at the start of an
+// anonymous reservation at least one byte longer than the file, so the byte
+// after the last one is always a zero-filled '\0' sentinel: either the tail
+// of the file's last page or the first byte of the reserved page after it.
+static bool source_map_file(struct SourceFile* source, int fd, size_t size)
+{
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t map_size = (size + 1 + page - 1) & ~(page - 1);
+
+  char* base = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(base == MAP_FAILED) {
+    stats.syscalls++;
+    return false;
+  }
+
+  if(mmap(base, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+    munmap(base, map_size);
+    stats.syscalls += 3;
+    return false;
+  }
+  madvise(base, size, MADV_SEQUENTIAL);
+  stats.syscalls += 3;
+
+  source->buffer = base;
+  source->size = size;
+  source->map_size = map_size;
+  return true;
+}
+
+// Moves the text in [from, to) of a line being spliced back to out, and
+// returns where the next text goes. Once the text reaches the newline that
+// ends the logical line, the room the splices took is filled with spaces
+// before it and the rest is left where it is.
+static size_t splice_move(char* buffer, size_t out, size_t from, size_t to)
+{
+  if(out == from) return to;
+  const char* newline = memchr(buffer + from, '\n', to - from);
+  if(!newline) {
+    memmove(buffer + out, buffer + from, to - from);
+    stats.splice_bytes += to - from;
+    return out + to - from;
+  }
+  size_t line_end = (size_t)(newline - buffer);
+  memmove(buffer + out, buffer + from, line_end - from);
+  memset(buffer + out + line_end - from, ' ', from - out);
+  stats.splice_bytes += line_end - out;
+  return to;
+}
+
+// Translation phase 2. The pre-scan is a vectorized search for the first
+// backslash-newline, so files without one keep the loaded buffer as is.
+// Otherwise the lines are spliced in place, one logical line at a time:
+// the text after each splice is moved back over it, and the room that
+// leaves is made spaces at the end of the logical line, where they change
+// nothing. Text before a splice's logical line is never written, so only
+// the pages of a mapped file that have splices on them are copied. The
+// kernel jumps from splice to splice and the offset of every removed
+// newline is recorded so the lexer can keep counting physical lines.
+static void source_splice_lines(struct SourceFile* source)
+{
+  char* buffer = source->buffer;
+  size_t size = source->size;
+  size_t i = scan_find_splice(buffer, size);
+  if(i == size) return;
+
+  // The file's pages are private, so writing them leaves the file alone
+  if(source->map_size) {
+    if(mprotect(buffer, size, PROT_READ | PROT_WRITE)) {
+      error("Failed to make %s writable to splice its lines.\n", source->name);
+    }
+    stats.syscalls++;
+  }
+  Array(size_t) splices = array_new();
+  array_capacity(splices) = 0;
+  array_length(splices) = 0;
+  array_ensure(&splices, 16);
+
+  size_t copied = 0;
+  size_t out = 0;
+  while(i < size) {
+    size_t next = i + 2;
+    if(buffer[i + 1] == '\r') {
+      if(i + 2 < size && buffer[i + 2] == '\n') {
+        next++;
+      } else { // A lone carriage return is not a line ending
+        i = next + scan_find_splice(buffer + next, size - next);
+        continue;
+      }
+    }
+    out = splice_move(buffer, out, copied, i);
+    if(array_length(splices) >= array_capacity(splices)) {
+      array_ensure(&splices, 2 * array_capacity(splices));
+    }
+    splices[array_length(splices)++] = out;
+    copied = next;
+    i = copied + scan_find_splice(buffer + copied, size - copied);
+  }
+  out = splice_move(buffer, out, copied, size);
+  if(out < size) { // The file ended in the middle of a logical line
+    memset(buffer + out, ' ', size - out);
+    stats.splice_bytes += size - out;
+  }
+
+  source->splices = splices;
+  source->splice_count = array_length(splices);
+  stats.spliced++;
+}
+
+static int source_append(struct SourceFile source)
+{
+  if(!sources) {
+    sources = array_new();
+    array_capacity(sources) = 0;
+    array_length(sources) = 0;
+    array_ensure(&sources, 16);
+    loaded = array_new();
+    array_capacity(loaded) = 0;
+    array_length(loaded) = 0;
+    array_ensure(&loaded, 16);
+  }
+  if(array_length(sources) >= array_capacity(sources)) {
+    array_ensure(&sources, 2 * array_capacity(sources));
+  }
+  sources[array_length(sources)++] = source;
+  return (int)array_length(sources) - 1;
+}
+
+int source_find_file(const char* filename)
+{
+  if(!sources) return -1;
+  for(size_t i = 0; i < array_length(loaded); i++) {
+    if(!strcmp(loaded[i].name, filename)) return loaded[i].id;
+  }
+  return -1;
+}
+
+static void add_loaded(const char* name, int id, const struct stat* st)
+{
+  if(array_length(loaded) >= array_capacity(loaded)) {
+    array_ensure(&loaded, 2 * array_capacity(loaded));
+  }
+  loaded[array_length(loaded)++] = (struct LoadedFile){
+    .name = name,
+    .id = id,
+    .dev = st ? st->st_dev : 0,
+    .ino = st ? st->st_ino : 0,
+    .mtime = st ? st->st_mtime : 0,
+    .size = st ? st->st_size : -1
+  };
+}
+
+static int find_loaded(const struct stat* st)
+{
+  for(size_t i = 0; i < array_length(loaded); i++) {
+    const struct LoadedFile* file = &loaded[i];
+    if(file->ino == st->st_ino && file->dev == st->st_dev
+       && file->mtime == st->st_mtime && file->size == st->st_size) {
+      return file->id;
+    }
+  }
+  return -1;
+}
+
+int source_add_file(const char* filename, int parent, int parent_line)
+{
+  int known = source_find_file(filename);
+  if(known >= 0) return known;
+
+  FILE* file = fopen(filename, "r");
+  stats.syscalls++;
+  if(!file) {
+    error("Did not find file %s.\n", filename);
+  }
+
+  struct stat st;
+  bool have_stat = fstat(fileno(file), &st) == 0;
+  stats.syscalls++;
+  if(have_stat && sources) {
+    known = find_loaded(&st);
+    if(known >= 0) {
+      fclose(file);
+      stats.syscalls++;
+      stats.shared++;
+      add_loaded(strdup(filename), known, &st);
+      return known;
+    }
+  }
+
+  struct SourceFile source = {
+    .name = strdup(filename),
+    .kind = SOURCE_FILE,
+    .parent = parent,
+    .parent_line = parent_line
+  };
+  stats.opened++;
+  if(have_stat && S_ISREG(st.st_mode) && st.st_size > 0
+     && source_map_file(&source, fileno(file), (size_t)st.st_size)) {
+    fclose(file);
+    stats.syscalls++;
+  } else {
+    source_read_file(&source, file);
+  }
+  source_splice_lines(&source);
+
+  int id = source_append(source);
+  add_loaded(source.name, id, have_stat ? &st : NULL);
+  return id;
+}
+
+int source_add_expansion(int parent, int parent_line, char* buffer, size_t size)
+{
+  struct SourceFile source = {
+    .name = sources[parent].name,
+    .buffer = buffer,
+    .size = size,
+    .map_size = 0,
+    .kind = SOURCE_EXPANSION,
+    .parent = parent,
+    .parent_line = parent_line
+  };
+  return source_append(source);
+}
+
+const struct SourceFile* source_get(int id)
+{
+  return &sources[id];
+}
+
+const char* source_name(int id)
+{
+  return sources[id].name;
+}
+
+int source_count()
+{
+  return sources ? (int)array_length(sources) : 0;
+}
+
+void source_release_all()
+{
+  if(!sources) return;
+  for(size_t i = 0; i < array_length(loaded); i++) {
+    if(loaded[i].name != sources[loaded[i].id].name) {
+      free((char*)loaded[i].name);
+    }
+  }
+  for(size_t i = 0; i < array_length(sources); i++) {
+    struct SourceFile* source = &sources[i];
+    if(source->kind == SOURCE_EXPANSION) continue; // Buffer is owned by the lexer
+    if(source->splices) array_free(source->splices);
+    if(source->map_size) munmap(source->buffer, source->map_size);
+    else free(source->buffer);
+    free((char*)source->name);
+  }
+  array_free(sources);
+  array_free(loaded);
+  sources = NULL;
+  loaded = NULL;
+  stats = (struct SourceStats){0};
+}
+
+void source_stats(struct SourceStats* out)
+{
+  *out = stats;
+}
@@ -1,23 +1,22 @@
 #include "compiler.h"
+#include "scan.h"
 
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-unsigned long strview_hash(struct string_view sv)
+uint64_t strview_hash(struct string_view sv)
 {
-  const uint64_t fnv_offset_basis_64 = 0xcbf29ce484222325;
-  const uint64_t fnv_prime_64 = 0x00000100000001B3;
-
-  uint64_t hash = fnv_offset_basis_64;
-
-  for(size_t i = 0; i < sv.length; i++) {
-    hash ^= (uint8_t)sv.begin[i];
-    hash *= fnv_prime_64;
+  uint64_t hash = HASH_SEED;
+  size_t i = 0;
+  for(; i + 8 <= sv.length; i += 8) {
+    hash = hash_word(hash, swar_load(sv.begin + i));
   }
-
-  return hash;
+  if(i < sv.length) {
+    hash = hash_word(hash, swar_load_partial(sv.begin + i, sv.length - i));
+  }
+  return hash_finish(hash, sv.length);
 }
 
 size_t array_sv_capacity(Array(struct string_view) array)
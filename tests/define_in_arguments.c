@@ -0,0 +1,45 @@
+#define F(a, ...) a __VA_ARGS__
+// Growing the macro table while the arguments of F are collected
+F(1,
+#define D_1 1
+#define D_2 2
+#define D_3 3
+#define D_4 4
+#define D_5 5
+#define D_6 6
+#define D_7 7
+#define D_8 8
+#define D_9 9
+#define D_10 10
+#define D_11 11
+#define D_12 12
+#define D_13 13
+#define D_14 14
+#define D_15 15
+#define D_16 16
+#define D_17 17
+#define D_18 18
+#define D_19 19
+#define D_20 20
+#define D_21 21
+#define D_22 22
+#define D_23 23
+#define D_24 24
+#define D_25 25
+#define D_26 26
+#define D_27 27
+#define D_28 28
+#define D_29 29
+#define D_30 30
+#define D_31 31
+#define D_32 32
+#define D_33 33
+#define D_34 34
+#define D_35 35
+#define D_36 36
+#define D_37 37
+#define D_38 38
+#define D_39 39
+#define D_40 40
+  2, 3)
+D_40
@@ -0,0 +1,3 @@
+// Adds to the header of the same name further along the search path
+#include_next <wrapped.h>
+int first_wrapped;
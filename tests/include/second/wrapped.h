@@ -0,0 +1,2 @@
+#include <plain.h>
+int second_wrapped;
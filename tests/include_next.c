@@ -0,0 +1,4 @@
+// #include_next resumes the search after the directory of the file it is in
+#include <wrapped.h>
+#include "wrapped.h"
+#include_next <plain.h>
@@ -0,0 +1,22 @@
+#!/bin/sh
+# Runs ccomp on each tests/*.c and compares the spellings of the tokens it
+# prints, one per line, or the error it stops with, with <name>.expected.
+# The options in <name>.flags, if there is one, are passed to ccomp.
+# Usage: tests/run.sh [ccomp]
+ccomp=$(realpath "${1:-./ccomp}")
+cd "$(dirname "$0")" || exit 1
+failed=0
+for test in *.c; do
+  expected=${test%.c}.expected
+  flags=$(cat "${test%.c}.flags" 2>/dev/null)
+  actual=$("$ccomp" "$test" $flags 2>&1 | grep -v '^Hello, World!' \
+           | sed 's/ at line: .*//') 2>/dev/null
+  if [ "$actual" = "$(cat "$expected")" ]; then
+    echo "ok    $test"
+  else
+    echo "FAIL  $test"
+    echo "$actual" | diff "$expected" - | head -20
+    failed=$((failed + 1))
+  fi
+done
+[ "$failed" -eq 0 ]
@@ -0,0 +1,32 @@
+// Directives in a group that is skipped, with comments before them
+#if 0
+/* comment */ #if 1
+  not_read_1
+/* comment */ # endif
+  not_read_2
+/* a comment
+   over two lines */ #else
+  read_0
+#endif
+#ifdef NOT_DEFINED
+  x /* not a directive */ #endif
+  not_read_4
+/**/#elif 1
+  read_1
+#endif
+#if 0
+  "/*" #else
+  not_read_5
+  /* #endif */
+  // #endif
+  not_read_6
+/* c */ /* c */ #else
+  read_2
+#endif
+#if 0
+  char *s = "http://x"; /*
+#endif
+  */
+  not_read_7
+#endif
+read_3
@@ -0,0 +1,14 @@
+// Line splices, in and between tokens
+#define LONG_MACRO(a, b) \
+  ((a) + \
+   (b))
+int sp\
+liced = LONG_MACRO(1, 2);
+const char* s = "one \
+two";
+int after_crlf\
+_splice = 3; /* comment \
+ over */ int x;
+// a line comment \
+   continued
+int last = 4 \
@@ -0,0 +1,25 @@
+// The whitespace before a macro name goes to the first token of what it
+// expands to, and shows when that is stringified
+#define E x
+#define S(x) #x
+#define XS(x) S(x)
+const char* a = XS(1 E);
+const char* b = XS(1 E E);
+#define F(a) a
+const char* c = XS(-F(1)+F( 2));
+
+// From the C standard's examples of ##
+#define hash_hash # ## #
+#define mkstr(a) # a
+#define in_between(a) mkstr(a)
+#define join(c, d) in_between(c hash_hash d)
+char p[] = join(x, y);
+
+// A space before an empty argument or expansion is kept for what follows
+#define EMPTY
+#define G(a, b) S([a b])
+const char* d = G(, y);
+const char* e = G(x, y);
+const char* f = XS(a EMPTY b);
+const char* g = XS(a F() b);
+const char* h = XS(F(F(1)) F( 2 ));
@@ -0,0 +1,405 @@
+#define U_1 1
+#define U_2 2
+#define U_3 3
+#define U_4 4
+#define U_5 5
+#define U_6 6
+#define U_7 7
+#define U_8 8
+#define U_9 9
+#define U_10 10
+#define U_11 11
+#define U_12 12
+#define U_13 13
+#define U_14 14
+#define U_15 15
+#define U_16 16
+#define U_17 17
+#define U_18 18
+#define U_19 19
+#define U_20 20
+#define U_21 21
+#define U_22 22
+#define U_23 23
+#define U_24 24
+#define U_25 25
+#define U_26 26
+#define U_27 27
+#define U_28 28
+#define U_29 29
+#define U_30 30
+#define U_31 31
+#define U_32 32
+#define U_33 33
+#define U_34 34
+#define U_35 35
+#define U_36 36
+#define U_37 37
+#define U_38 38
+#define U_39 39
+#define U_40 40
+#define U_41 41
+#define U_42 42
+#define U_43 43
+#define U_44 44
+#define U_45 45
+#define U_46 46
+#define U_47 47
+#define U_48 48
+#define U_49 49
+#define U_50 50
+#define U_51 51
+#define U_52 52
+#define U_53 53
+#define U_54 54
+#define U_55 55
+#define U_56 56
+#define U_57 57
+#define U_58 58
+#define U_59 59
+#define U_60 60
+#define U_61 61
+#define U_62 62
+#define U_63 63
+#define U_64 64
+#define U_65 65
+#define U_66 66
+#define U_67 67
+#define U_68 68
+#define U_69 69
+#define U_70 70
+#define U_71 71
+#define U_72 72
+#define U_73 73
+#define U_74 74
+#define U_75 75
+#define U_76 76
+#define U_77 77
+#define U_78 78
+#define U_79 79
+#define U_80 80
+#define U_81 81
+#define U_82 82
+#define U_83 83
+#define U_84 84
+#define U_85 85
+#define U_86 86
+#define U_87 87
+#define U_88 88
+#define U_89 89
+#define U_90 90
+#define U_91 91
+#define U_92 92
+#define U_93 93
+#define U_94 94
+#define U_95 95
+#define U_96 96
+#define U_97 97
+#define U_98 98
+#define U_99 99
+#define U_100 100
+#define U_101 101
+#define U_102 102
+#define U_103 103
+#define U_104 104
+#define U_105 105
+#define U_106 106
+#define U_107 107
+#define U_108 108
+#define U_109 109
+#define U_110 110
+#define U_111 111
+#define U_112 112
+#define U_113 113
+#define U_114 114
+#define U_115 115
+#define U_116 116
+#define U_117 117
+#define U_118 118
+#define U_119 119
+#define U_120 120
+#define U_121 121
+#define U_122 122
+#define U_123 123
+#define U_124 124
+#define U_125 125
+#define U_126 126
+#define U_127 127
+#define U_128 128
+#define U_129 129
+#define U_130 130
+#define U_131 131
+#define U_132 132
+#define U_133 133
+#define U_134 134
+#define U_135 135
+#define U_136 136
+#define U_137 137
+#define U_138 138
+#define U_139 139
+#define U_140 140
+#define U_141 141
+#define U_142 142
+#define U_143 143
+#define U_144 144
+#define U_145 145
+#define U_146 146
+#define U_147 147
+#define U_148 148
+#define U_149 149
+#define U_150 150
+#define U_151 151
+#define U_152 152
+#define U_153 153
+#define U_154 154
+#define U_155 155
+#define U_156 156
+#define U_157 157
+#define U_158 158
+#define U_159 159
+#define U_160 160
+#define U_161 161
+#define U_162 162
+#define U_163 163
+#define U_164 164
+#define U_165 165
+#define U_166 166
+#define U_167 167
+#define U_168 168
+#define U_169 169
+#define U_170 170
+#define U_171 171
+#define U_172 172
+#define U_173 173
+#define U_174 174
+#define U_175 175
+#define U_176 176
+#define U_177 177
+#define U_178 178
+#define U_179 179
+#define U_180 180
+#define U_181 181
+#define U_182 182
+#define U_183 183
+#define U_184 184
+#define U_185 185
+#define U_186 186
+#define U_187 187
+#define U_188 188
+#define U_189 189
+#define U_190 190
+#define U_191 191
+#define U_192 192
+#define U_193 193
+#define U_194 194
+#define U_195 195
+#define U_196 196
+#define U_197 197
+#define U_198 198
+#define U_199 199
+#define U_200 200
+#define F(a, ...) a __VA_ARGS__
+// Shrinking the macro table while the arguments of F are collected
+F(1,
+#undef U_1
+#undef U_2
+#undef U_3
+#undef U_4
+#undef U_5
+#undef U_6
+#undef U_7
+#undef U_8
+#undef U_9
+#undef U_10
+#undef U_11
+#undef U_12
+#undef U_13
+#undef U_14
+#undef U_15
+#undef U_16
+#undef U_17
+#undef U_18
+#undef U_19
+#undef U_20
+#undef U_21
+#undef U_22
+#undef U_23
+#undef U_24
+#undef U_25
+#undef U_26
+#undef U_27
+#undef U_28
+#undef U_29
+#undef U_30
+#undef U_31
+#undef U_32
+#undef U_33
+#undef U_34
+#undef U_35
+#undef U_36
+#undef U_37
+#undef U_38
+#undef U_39
+#undef U_40
+#undef U_41
+#undef U_42
+#undef U_43
+#undef U_44
+#undef U_45
+#undef U_46
+#undef U_47
+#undef U_48
+#undef U_49
+#undef U_50
+#undef U_51
+#undef U_52
+#undef U_53
+#undef U_54
+#undef U_55
+#undef U_56
+#undef U_57
+#undef U_58
+#undef U_59
+#undef U_60
+#undef U_61
+#undef U_62
+#undef U_63
+#undef U_64
+#undef U_65
+#undef U_66
+#undef U_67
+#undef U_68
+#undef U_69
+#undef U_70
+#undef U_71
+#undef U_72
+#undef U_73
+#undef U_74
+#undef U_75
+#undef U_76
+#undef U_77
+#undef U_78
+#undef U_79
+#undef U_80
+#undef U_81
+#undef U_82
+#undef U_83
+#undef U_84
+#undef U_85
+#undef U_86
+#undef U_87
+#undef U_88
+#undef U_89
+#undef U_90
+#undef U_91
+#undef U_92
+#undef U_93
+#undef U_94
+#undef U_95
+#undef U_96
+#undef U_97
+#undef U_98
+#undef U_99
+#undef U_100
+#undef U_101
+#undef U_102
+#undef U_103
+#undef U_104
+#undef U_105
+#undef U_106
+#undef U_107
+#undef U_108
+#undef U_109
+#undef U_110
+#undef U_111
+#undef U_112
+#undef U_113
+#undef U_114
+#undef U_115
+#undef U_116
+#undef U_117
+#undef U_118
+#undef U_119
+#undef U_120
+#undef U_121
+#undef U_122
+#undef U_123
+#undef U_124
+#undef U_125
+#undef U_126
+#undef U_127
+#undef U_128
+#undef U_129
+#undef U_130
+#undef U_131
+#undef U_132
+#undef U_133
+#undef U_134
+#undef U_135
+#undef U_136
+#undef U_137
+#undef U_138
+#undef U_139
+#undef U_140
+#undef U_141
+#undef U_142
+#undef U_143
+#undef U_144
+#undef U_145
+#undef U_146
+#undef U_147
+#undef U_148
+#undef U_149
+#undef U_150
+#undef U_151
+#undef U_152
+#undef U_153
+#undef U_154
+#undef U_155
+#undef U_156
+#undef U_157
+#undef U_158
+#undef U_159
+#undef U_160
+#undef U_161
+#undef U_162
+#undef U_163
+#undef U_164
+#undef U_165
+#undef U_166
+#undef U_167
+#undef U_168
+#undef U_169
+#undef U_170
+#undef U_171
+#undef U_172
+#undef U_173
+#undef U_174
+#undef U_175
+#undef U_176
+#undef U_177
+#undef U_178
+#undef U_179
+#undef U_180
+#undef U_181
+#undef U_182
+#undef U_183
+#undef U_184
+#undef U_185
+#undef U_186
+#undef U_187
+#undef U_188
+#undef U_189
+#undef U_190
+#undef U_191
+#undef U_192
+#undef U_193
+#undef U_194
+#undef U_195
+#undef U_196
+#undef U_197
+#undef U_198
+#undef U_199
+#undef U_200
+  2, 3)
+U_1
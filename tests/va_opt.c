@@ -0,0 +1,32 @@
+// The C23 examples of __VA_OPT__, and # applied to it
+#define F(...) f(0 __VA_OPT__(,) __VA_ARGS__)
+#define G(X, ...) f(0, X __VA_OPT__(,) __VA_ARGS__)
+#define SDEF(sname, ...) S sname __VA_OPT__(= { __VA_ARGS__ })
+#define EMP
+F(a, b, c) F() F(EMP)
+G(a, b, c) G(a, ) G(a)
+SDEF(foo); SDEF(bar, 1, 2);
+#define H2(X, Y, ...) __VA_OPT__(X ## Y,) __VA_ARGS__
+H2(a, b, c, d)
+#define H3(X, ...) #__VA_OPT__(X##X X##X)
+H3(, 0)
+#define H4(X, ...) __VA_OPT__(a X ## X) ## b
+H4(, 1)
+#define H5A(...) __VA_OPT__()/**/__VA_OPT__()
+#define H5B(X) a ## X ## b
+#define H5C(X) H5B(X)
+H5C(H5A())
+
+// The other parameters are replaced by their expanded arguments, and the
+// rest is not rescanned
+#define E 1
+#define H6(X, ...) # __VA_OPT__( X  E [__VA_ARGS__] "q\\" )
+H6(E, E, x) H6(E)
+#define H7(...) #__VA_OPT__(x ## __VA_ARGS__ ## y) + #__VA_OPT__()
+H7(a b) H7()
+
+// An empty __VA_OPT__() is a placemarker even when there are variable
+// arguments, so it leaves the other operand of ## as it is
+#define F2(a, ...) a ## __VA_OPT__()
+#define K2(a, ...) __VA_OPT__() ## a
+F2(x, 1) K2(y, 1)